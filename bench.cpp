@@ -0,0 +1,381 @@
+#include "igzip_wrapper.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Throughput matrix: compress and decompress every corpus at every input
+ * size, level, thread count and block size, memory to memory so the disk
+ * stays out of the numbers. Each row is one configuration after a warm up
+ * call, timed over --rounds calls.
+ */
+
+#define READ_BUF_ONCE 1024 * 1024
+
+struct corpus {
+  std::string name;
+  std::vector<unsigned char> data;
+};
+
+struct row {
+  std::string engine;
+  std::string corpus;
+  size_t input_size;
+  std::string op;
+  int level;
+  int threads;
+  size_t block_size;
+  double mb_s;
+  double ratio;
+  double p50_ms;
+  double p99_ms;
+  long peak_rss_kb;
+};
+
+static uint64_t lcg_state = 88172645463325252ull;
+
+static uint32_t lcg_next() {
+  lcg_state = lcg_state * 6364136223846793005ull + 1442695040888963407ull;
+  return (uint32_t)(lcg_state >> 33);
+}
+
+// Log-like lines from a small vocabulary, around 4:1 with gzip
+static void fill_text(std::vector<unsigned char> &out, size_t length) {
+  static const char *words[] = {"GET",     "POST",   "/api/v1/items", "200",
+                                "404",     "user",   "session",       "cache",
+                                "timeout", "worker", "request",       "ms",
+                                "INFO",    "WARN",   "ERROR",         "id="};
+  std::string line;
+  out.clear();
+  while (out.size() < length) {
+    line = std::to_string(1600000000 + lcg_next() % 100000);
+    for (int i = 0, n = 4 + lcg_next() % 8; i < n; i++) {
+      line += ' ';
+      line += words[lcg_next() % 16];
+      if (lcg_next() % 4 == 0)
+        line += std::to_string(lcg_next() % 1000);
+    }
+    line += '\n';
+    out.insert(out.end(), line.begin(), line.end());
+  }
+  out.resize(length);
+}
+
+static void fill_random(std::vector<unsigned char> &out, size_t length) {
+  out.resize(length);
+  for (size_t i = 0; i < length; i++)
+    out[i] = (unsigned char)lcg_next();
+}
+
+// Text with incompressible 64 KiB runs in between, as archives of media do
+static void fill_mixed(std::vector<unsigned char> &out, size_t length) {
+  std::vector<unsigned char> part;
+  out.clear();
+  for (int i = 0; out.size() < length; i++) {
+    if (i % 3 == 2)
+      fill_random(part, 64 * 1024);
+    else
+      fill_text(part, 64 * 1024);
+    out.insert(out.end(), part.begin(), part.end());
+  }
+  out.resize(length);
+}
+
+static bool load_corpus(const char *file_name, corpus &c) {
+  FILE *fp = fopen(file_name, "rb");
+  if (fp == NULL)
+    return false;
+  c.name = file_name;
+  c.data.clear();
+  std::vector<unsigned char> buf(READ_BUF_ONCE);
+  size_t read;
+  while ((read = fread(buf.data(), 1, buf.size(), fp)) > 0)
+    c.data.insert(c.data.end(), buf.begin(), buf.begin() + read);
+  fclose(fp);
+  return true;
+}
+
+// Restart the VmHWM high water mark from the current RSS, Linux only
+static void reset_peak_rss() {
+  FILE *fp = fopen("/proc/self/clear_refs", "w");
+  if (fp != NULL) {
+    fputs("5", fp);
+    fclose(fp);
+  }
+}
+
+static long peak_rss_kb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line))
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return atol(line.c_str() + 6);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static double percentile(std::vector<double> samples, double p) {
+  std::sort(samples.begin(), samples.end());
+  size_t i = (size_t)(p * (samples.size() - 1) + 0.5);
+  return samples[i];
+}
+
+// Time rounds calls of run after one warm up call, in milliseconds
+template <typename F>
+static std::vector<double> time_rounds(int rounds, F run) {
+  std::vector<double> ms;
+  if (run() != 0)
+    return ms;
+  for (int round = 0; round < rounds; round++) {
+    std::chrono::steady_clock::time_point begin =
+        std::chrono::steady_clock::now();
+    run();
+    std::chrono::steady_clock::time_point end =
+        std::chrono::steady_clock::now();
+    ms.push_back(
+        std::chrono::duration<double, std::milli>(end - begin).count());
+  }
+  return ms;
+}
+
+static void fill_row(row &r, const std::vector<double> &ms, size_t in_len,
+                     size_t out_len) {
+  r.p50_ms = percentile(ms, 0.5);
+  r.p99_ms = percentile(ms, 0.99);
+  r.mb_s = in_len / (r.p50_ms / 1000) / (1024 * 1024);
+  r.ratio = out_len > 0 ? (double)in_len / out_len : 0;
+  r.peak_rss_kb = peak_rss_kb();
+}
+
+static std::vector<size_t> parse_list(const char *arg) {
+  std::vector<size_t> list;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    list.push_back(strtoull(item.c_str(), NULL, 0));
+  return list;
+}
+
+static void print_csv(std::ostream &os, const std::vector<row> &rows) {
+  os << "engine,corpus,input_size,op,level,threads,block_size,mb_s,ratio,"
+        "p50_ms,p99_ms,peak_rss_kb\n";
+  for (const row &r : rows)
+    os << r.engine << "," << r.corpus << "," << r.input_size << "," << r.op
+       << "," << r.level << "," << r.threads << "," << r.block_size << ","
+       << r.mb_s << "," << r.ratio << "," << r.p50_ms << "," << r.p99_ms << ","
+       << r.peak_rss_kb << "\n";
+}
+
+static void print_json(std::ostream &os, const std::vector<row> &rows) {
+  os << "[\n";
+  for (size_t i = 0; i < rows.size(); i++) {
+    const row &r = rows[i];
+    os << "  {\"engine\": \"" << r.engine << "\", \"corpus\": \"" << r.corpus
+       << "\", \"input_size\": " << r.input_size << ", \"op\": \"" << r.op
+       << "\", \"level\": " << r.level << ", \"threads\": " << r.threads
+       << ", \"block_size\": " << r.block_size << ", \"mb_s\": " << r.mb_s
+       << ", \"ratio\": " << r.ratio << ", \"p50_ms\": " << r.p50_ms
+       << ", \"p99_ms\": " << r.p99_ms
+       << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}"
+       << (i + 1 < rows.size() ? ",\n" : "\n");
+  }
+  os << "]\n";
+}
+
+static void usage(const char *name) {
+  std::cerr
+      << "usage: " << name << " [options] [corpus-file ...]\n"
+      << "  --csv FILE           CSV report to FILE\n"
+      << "  --json FILE          JSON report to FILE\n"
+      << "                       (CSV to stdout without either)\n"
+      << "  --rounds N           timed calls per configuration (10)\n"
+      << "  --levels L,...       compression levels (0,1,2,3)\n"
+      << "  --threads T,...      thread counts (1,2,4,.. up to the cores)\n"
+      << "  --blocks B,...       block sizes in bytes (64K,1M,8M)\n"
+      << "  --sizes S,...        generated corpus sizes (64K,1M,16M)\n"
+      << "  --quick              smaller matrix for a smoke run\n";
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<size_t> levels = {0, 1, 2, 3};
+  std::vector<size_t> threads;
+  std::vector<size_t> blocks = {MIN_BLOCK_SIZE, BLOCK_SIZE, MAX_BLOCK_SIZE};
+  std::vector<size_t> sizes = {64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+  std::vector<corpus> corpora;
+  const char *csv_name = NULL, *json_name = NULL;
+  int rounds = 10;
+
+  for (int max = std::thread::hardware_concurrency(), t = 1; t <= max; t *= 2)
+    threads.push_back(t);
+  if (threads.empty())
+    threads.push_back(1);
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--quick") {
+      rounds = 3;
+      levels = {1, 3};
+      blocks = {MIN_BLOCK_SIZE, BLOCK_SIZE};
+      sizes = {64 * 1024, 4 * 1024 * 1024};
+      threads.resize(std::min<size_t>(threads.size(), 2));
+    } else if (arg == "--csv" && has_value) {
+      csv_name = argv[++i];
+    } else if (arg == "--json" && has_value) {
+      json_name = argv[++i];
+    } else if (arg == "--rounds" && has_value) {
+      rounds = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--levels" && has_value) {
+      levels = parse_list(argv[++i]);
+    } else if (arg == "--threads" && has_value) {
+      threads = parse_list(argv[++i]);
+    } else if (arg == "--blocks" && has_value) {
+      blocks = parse_list(argv[++i]);
+    } else if (arg == "--sizes" && has_value) {
+      sizes = parse_list(argv[++i]);
+    } else if (arg[0] == '-') {
+      usage(argv[0]);
+      return -1;
+    } else {
+      corpus c;
+      if (!load_corpus(argv[i], c)) {
+        log_print(ERROR, "Cannot load corpus file\n");
+        return -1;
+      }
+      corpora.push_back(c);
+    }
+  }
+
+  // Generated corpora at every size, real files as they are
+  for (size_t size : sizes) {
+    corpus text, random, mixed;
+    text.name = "text";
+    fill_text(text.data, size);
+    random.name = "random";
+    fill_random(random.data, size);
+    mixed.name = "mixed";
+    fill_mixed(mixed.data, size);
+    corpora.push_back(text);
+    corpora.push_back(random);
+    corpora.push_back(mixed);
+  }
+
+  size_t max_len = 0;
+  for (const corpus &c : corpora)
+    max_len = std::max(max_len, c.data.size());
+  std::vector<unsigned char> packed(compress_bound(max_len));
+  std::vector<unsigned char> unpacked(max_len + 1);
+  std::vector<row> rows;
+
+  for (size_t level : levels) {
+    for (size_t thread_num : threads) {
+      for (size_t block_size : blocks) {
+        igzip_options opts;
+        igzip_options_init(&opts);
+        opts.level = (int)level;
+        opts.thread_num = (int)thread_num;
+        opts.block_size = block_size;
+        compress_ctx *ctx = compress_ctx_create_opts(&opts);
+        if (ctx == NULL)
+          continue;
+
+        for (const corpus &c : corpora) {
+          // Blocks past the input size repeat the smaller block's numbers
+          if (block_size != blocks[0] && block_size / 2 >= c.data.size())
+            continue;
+          unsigned char *in = (unsigned char *)c.data.data();
+          size_t in_len = c.data.size(), out_len = 0, got = 0;
+          // the measurements are filled in by fill_row
+          row r = {"igzip", c.name, in_len, "compress", (int)level,
+                   (int)thread_num, block_size, 0, 0, 0, 0, 0};
+
+          reset_peak_rss();
+          std::vector<double> ms = time_rounds(rounds, [&] {
+            return compress_buffer_ctx(ctx, in, in_len, packed.data(),
+                                       packed.size(), &out_len);
+          });
+          if (ms.empty())
+            continue;
+          fill_row(r, ms, in_len, out_len);
+          rows.push_back(r);
+
+          r.op = "decompress";
+          reset_peak_rss();
+          ms = time_rounds(rounds, [&] {
+            return decompress_buffer(packed.data(), out_len, unpacked.data(),
+                                     unpacked.size(), &got, (int)thread_num);
+          });
+          if (ms.empty() || got != in_len ||
+              memcmp(unpacked.data(), in, in_len) != 0) {
+            log_print(ERROR, "Round trip mismatch\n");
+            return -1;
+          }
+          fill_row(r, ms, in_len, out_len);
+          rows.push_back(r);
+        }
+        compress_ctx_destroy(ctx);
+      }
+    }
+  }
+
+#ifdef HAVE_ZLIB
+  // Single thread zlib at its fastest and default levels
+  for (int zlevel : {1, 6}) {
+    for (const corpus &c : corpora) {
+      const Bytef *in = c.data.data();
+      uLong in_len = c.data.size();
+      uLongf out_len = 0, got = 0;
+      row r = {"zlib", c.name, in_len, "compress", zlevel, 1, 0, 0, 0, 0, 0, 0};
+
+      reset_peak_rss();
+      std::vector<double> ms = time_rounds(rounds, [&] {
+        out_len = packed.size();
+        return compress2(packed.data(), &out_len, in, in_len, zlevel);
+      });
+      if (ms.empty())
+        continue;
+      fill_row(r, ms, in_len, out_len);
+      rows.push_back(r);
+
+      r.op = "decompress";
+      reset_peak_rss();
+      ms = time_rounds(rounds, [&] {
+        got = unpacked.size();
+        return uncompress(unpacked.data(), &got, packed.data(), out_len);
+      });
+      if (ms.empty())
+        continue;
+      fill_row(r, ms, in_len, out_len);
+      rows.push_back(r);
+    }
+  }
+#endif
+
+  if (csv_name == NULL && json_name == NULL)
+    print_csv(std::cout, rows);
+  if (csv_name != NULL) {
+    std::ofstream file(csv_name);
+    print_csv(file, rows);
+    if (!file)
+      log_print(ERROR, "Cannot write CSV report\n");
+  }
+  if (json_name != NULL) {
+    std::ofstream file(json_name);
+    print_json(file, rows);
+    if (!file)
+      log_print(ERROR, "Cannot write JSON report\n");
+  }
+  return 0;
+}
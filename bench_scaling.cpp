@@ -0,0 +1,73 @@
+#include "igzip_wrapper.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#define READ_BUF_ONCE 1024 * 1024
+#define ROUNDS 3
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " <uncompressed-source> <output-gzip-file> [max-threads]"
+              << std::endl;
+    return -1;
+  }
+
+  struct stat src_stat;
+  if (stat(argv[1], &src_stat) != 0) {
+    log_print(ERROR, "Cannot stat source file\n");
+    exit(-1);
+  }
+  size_t src_len = src_stat.st_size;
+  unsigned char *src = (unsigned char *)malloc(src_len + 1);
+  FILE *src_fp = fopen(argv[1], "rb");
+  if (src == NULL || src_fp == NULL) {
+    log_print(ERROR, "Cannot load source file\n");
+    exit(-1);
+  }
+  for (size_t got = 0, read; got < src_len; got += read) {
+    read = fread(src + got, 1, READ_BUF_ONCE, src_fp);
+    if (read == 0)
+      break;
+  }
+  fclose(src_fp);
+
+  int max_threads = argc > 3 ? atoi(argv[3])
+                             : (int)std::thread::hardware_concurrency();
+  if (max_threads < 1)
+    max_threads = 1;
+
+  double base = 0;
+  std::cout << "threads,MB/s,speedup" << std::endl;
+  for (int threads = 1; threads <= max_threads; ++threads) {
+    // Pool startup is excluded, a context is built once per thread count
+    compress_ctx *ctx = compress_ctx_create(1, threads);
+    if (ctx == NULL)
+      exit(-1);
+
+    double best = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+      unlink(argv[2]);
+      std::chrono::steady_clock::time_point begin =
+          std::chrono::steady_clock::now();
+      compress_file_ctx(ctx, src, src_len, argv[2]);
+      std::chrono::steady_clock::time_point end =
+          std::chrono::steady_clock::now();
+      double secs = std::chrono::duration<double>(end - begin).count();
+      double mbps = src_len / secs / (1024 * 1024);
+      if (mbps > best)
+        best = mbps;
+    }
+    compress_ctx_destroy(ctx);
+
+    if (threads == 1)
+      base = best;
+    std::cout << threads << "," << best << "," << best / base << std::endl;
+  }
+
+  unlink(argv[2]);
+  free(src);
+  return 0;
+}
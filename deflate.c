@@ -1,10 +1,17 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_attr_setaffinity_np, sched_getcpu
+#endif
 #include "igzip_wrapper.h"
 /* Normally you use isa-l.h instead for external programs */
+#include "isa-l/crc.h"
 #include "isa-l/igzip_lib.h"
+#include <sys/mman.h>
 
 #if defined(HAVE_THREADS)
-#include "isa-l/crc.h"
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #endif
 
 #ifdef __cplusplus
@@ -66,10 +73,395 @@ int level_size_buf[10] = {
 #endif
 };
 
+// Level buffer that serves level and every level below, as adaptive picks
+static int level_buf_size(int level) {
+  int i, size = 0;
+  for (i = 0; i <= level; i++)
+    if (level_size_buf[i] > size)
+      size = level_size_buf[i];
+  return size;
+}
+
+/*
+ * Destination of one compression call, either a raw file descriptor or a
+ * caller owned buffer. A buffer that runs out of room is flagged as
+ * overflowed and takes no further writes. Output to a descriptor may be
+ * staged, in async_io buffers written behind by a helper thread or in an
+ * aligned buffer feeding O_DIRECT writes.
+ */
+struct compress_sink {
+  out_fd out;
+  int to_fd;
+  const char *name;
+  unsigned char *buf;
+  size_t capacity;
+  size_t length;
+  int overflow;
+  async_io *io;
+  unsigned char *stage; // staging buffer being filled, or NULL
+  size_t stage_len;
+  size_t stage_size;
+  igzip_stats *stats; // accounting of the call, used by one thread at a time
+};
+
+// Hand a full, or the final, staging buffer to the descriptor
+static void sink_emit_stage(struct compress_sink *sink) {
+  if (sink->io != NULL) {
+    async_write(sink->io, sink->stage_len);
+    sink->stage = async_write_buffer(sink->io);
+  } else {
+    struct iovec iov = {sink->stage, sink->stage_len};
+    out_fd_writev(&sink->out, &iov, 1);
+  }
+  sink->stage_len = 0;
+}
+
+// Write the gathered iov, which is used up in the process
+static int sink_writev(struct compress_sink *sink, struct iovec *iov,
+                       int iovcnt) {
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  if (sink->stage != NULL) {
+    for (i = 0; i < iovcnt; i++) {
+      const unsigned char *p = (const unsigned char *)iov[i].iov_base;
+      size_t left = iov[i].iov_len;
+      while (left > 0) {
+        size_t n = sink->stage_size - sink->stage_len;
+        if (n > left)
+          n = left;
+        uint64_t start = igzip_clock_ns();
+        memcpy(sink->stage + sink->stage_len, p, n);
+        sink->stats->copy_ns += igzip_clock_ns() - start;
+        sink->stage_len += n;
+        p += n;
+        left -= n;
+        if (sink->stage_len == sink->stage_size)
+          sink_emit_stage(sink);
+      }
+    }
+  } else if (sink->to_fd) {
+    out_fd_writev(&sink->out, iov, iovcnt);
+  } else {
+    if (sink->overflow || sink->capacity - sink->length < len) {
+      sink->overflow = 1;
+      return 1;
+    }
+    uint64_t start = igzip_clock_ns();
+    for (i = 0; i < iovcnt; i++) {
+      memcpy(sink->buf + sink->length, iov[i].iov_base, iov[i].iov_len);
+      sink->length += iov[i].iov_len;
+    }
+    sink->stats->write_ns += igzip_clock_ns() - start;
+    return 0;
+  }
+  sink->length += len;
+  return 0;
+}
+
+static int sink_write(struct compress_sink *sink, const void *data,
+                      size_t len) {
+  struct iovec iov = {(void *)data, len};
+  return sink_writev(sink, &iov, 1);
+}
+
+/*
+ * Write to fd from here on. A single thread compressor gets a helper thread
+ * writing behind it; the parallel path has its own writer thread, which
+ * gathers blocks straight from the job buffers unless O_DIRECT needs them
+ * staged into aligned runs.
+ */
+static void sink_open_fd(struct compress_sink *sink, int fd, const char *name,
+                         int thread_num, int direct, size_t buf_size,
+                         int depth) {
+  out_fd_init(&sink->out, fd, name, direct);
+  sink->to_fd = 1;
+  sink->name = name;
+  sink->stage_len = 0;
+  sink->stage_size = buf_size;
+  if (thread_num == 1) {
+    sink->io = async_writer_open(&sink->out, buf_size, depth);
+    sink->stage = async_write_buffer(sink->io);
+  } else if (sink->out.direct) {
+    sink->stage = (unsigned char *)cache_alloc(buf_size);
+  }
+}
+
+// Get everything written so far out to the descriptor
+static void sink_flush(struct compress_sink *sink) {
+  if (sink->stage != NULL && sink->stage_len > 0)
+    sink_emit_stage(sink);
+  if (sink->io != NULL)
+    async_flush(sink->io);
+}
+
+static void sink_close(struct compress_sink *sink) {
+  if (!sink->to_fd)
+    return;
+  sink_flush(sink);
+  if (sink->io != NULL) {
+    async_io_set_stats(sink->io, sink->stats);
+    async_io_close(sink->io);
+  } else {
+    cache_free(sink->stage, sink->stage_size);
+  }
+  sink->io = NULL;
+  sink->stage = NULL;
+  out_fd_finish(&sink->out);
+  sink->stats->write_calls += sink->out.writes;
+  sink->stats->write_ns += sink->out.write_ns;
+}
+
+/*
+ * BGZF output: every block is a complete gzip member holding at most
+ * BGZF_BLOCK_SIZE input bytes, with its compressed size recorded in a 'BC'
+ * EXTRA subfield so readers can find blocks without inflating them.
+ */
+#define BGZF_BLOCK_SIZE 0xff00    // input bytes per block, as bgzip uses
+#define BGZF_MAX_BLOCK 0x10000    // compressed block size limit
+#define BGZF_HEADER_SIZE 18
+#define BGZF_TRAILER_SIZE 8
+#define STORED_HEADER_SIZE 5
+
+static const uint8_t bgzf_eof_block[28] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+    27, 0,  3, 0, 0, 0, 0, 0, 0, 0,   0, 0};
+
+static inline void put_le16(uint8_t *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+  put_le16(p, v);
+  put_le16(p + 2, v >> 16);
+}
+
+#define ADAPTIVE_SAMPLE 16384   // bytes of a block scored by adaptive_level
+#define ADAPTIVE_MIN_BLOCK 4096 // smaller blocks keep the context level
+
+// Size of in_len bytes as stored deflate blocks
+static inline size_t stored_bound(size_t in_len) {
+  return in_len + STORED_HEADER_SIZE * (in_len / 0xffff + 1);
+}
+
+// in as stored blocks, the last one final if final is set; byte aligned
+static uint32_t deflate_stored(uint8_t *in, uint32_t in_len, uint8_t *out,
+                               int final) {
+  uint32_t written = 0;
+  do {
+    uint32_t n = in_len < 0xffff ? in_len : 0xffff;
+    out[written] = final && n == in_len; // BFINAL, BTYPE 00
+    put_le16(out + written + 1, n);
+    put_le16(out + written + 3, ~n);
+    memcpy(out + written + STORED_HEADER_SIZE, in, n);
+    written += STORED_HEADER_SIZE + n;
+    in += n;
+    in_len -= n;
+  } while (in_len > 0);
+  return written;
+}
+
+/*
+ * Level for a block in adaptive mode, at most level, or -1 to store it.
+ * A strided sample of up to ADAPTIVE_SAMPLE bytes is scored by its
+ * collision entropy, -log2 of the chance that two sampled bytes are equal,
+ * which needs only integer sums: already compressed or encrypted data sits
+ * close to 8 bits a byte and isn't worth deflating at all, dense binary
+ * data gains little from the slower levels.
+ */
+static int adaptive_level(const uint8_t *in, size_t in_len, int level) {
+  uint32_t count[256] = {0};
+  uint64_t n = 0, sum = 0;
+  size_t i, step = in_len / ADAPTIVE_SAMPLE + 1;
+  int c;
+
+  if (in_len < ADAPTIVE_MIN_BLOCK)
+    return level;
+  for (i = 0; i < in_len; i += step, n++)
+    count[in[i]]++;
+  for (c = 0; c < 256; c++)
+    sum += (uint64_t)count[c] * count[c];
+
+  // sum / n^2 against 2^-7.9, 2^-7 and 2^-6
+  if (sum * 10000 <= n * n * 42)
+    return -1;
+  if (sum * 128 <= n * n)
+    return 0;
+  if (sum * 64 <= n * n && level > 1)
+    return 1;
+  return level;
+}
+
+/*
+ * Deflate one block into out as a byte aligned run of deflate blocks, the
+ * last one final if final is set. It may refer back into dict, otherwise it
+ * stands alone. In adaptive mode the level comes from adaptive_level and a
+ * block deflate would grow is stored instead. Returns non-zero if out_len
+ * is too small.
+ */
+static int deflate_block(uint8_t *in, uint32_t in_len, uint8_t *out,
+                         uint32_t out_len, uint8_t *dict, uint32_t dict_len,
+                         int final, int level, uint8_t *level_buf,
+                         int level_size, int adaptive, uint32_t *total_out) {
+  struct isal_zstream wstream;
+  int check;
+
+  if (adaptive) {
+    level = adaptive_level(in, in_len, level);
+    if (out_len >= stored_bound(in_len)) {
+      if (level < 0) {
+        *total_out = deflate_stored(in, in_len, out, final);
+        return 0;
+      }
+      out_len = stored_bound(in_len); // deflate must beat storing
+    } else {
+      adaptive = 0;
+      if (level < 0)
+        level = 0;
+    }
+  }
+
+  if (dict_len == 0)
+    isal_deflate_stateless_init(&wstream);
+  else
+    isal_deflate_init(&wstream);
+  wstream.next_in = in;
+  wstream.next_out = out;
+  wstream.avail_in = in_len;
+  wstream.avail_out = out_len;
+  wstream.end_of_stream = final;
+  wstream.flush = FULL_FLUSH;
+  wstream.level = level;
+  wstream.level_buf = level_buf;
+  wstream.level_buf_size = level_size;
+
+  if (dict_len == 0) {
+    check = isal_deflate_stateless(&wstream);
+  } else {
+    // Matches may reach into the previous block, so history must survive
+    // the flush and the block can't go through the stateless path
+    wstream.flush = SYNC_FLUSH;
+    check = isal_deflate_set_dict(&wstream, dict, dict_len);
+    if (check == COMP_OK)
+      check = isal_deflate(&wstream);
+    if (check == COMP_OK && (wstream.avail_in != 0 || wstream.avail_out == 0))
+      check = STATELESS_OVERFLOW;
+  }
+
+  if (check != COMP_OK && adaptive) {
+    *total_out = deflate_stored(in, in_len, out, final);
+    return 0;
+  }
+  *total_out = wstream.total_out;
+  return check != COMP_OK;
+}
+
+/*
+ * Compress in as a run of BGZF blocks into out. Returns the bytes written,
+ * or 0 if out can't hold them.
+ */
+size_t bgzf_compress(uint8_t *in, size_t in_len, uint8_t *out, size_t out_len,
+                     int level, uint8_t *level_buf, int level_size,
+                     int adaptive) {
+  struct isal_zstream stream;
+  size_t written = 0;
+
+  while (in_len > 0) {
+    uint32_t block_in = in_len < BGZF_BLOCK_SIZE ? in_len : BGZF_BLOCK_SIZE;
+    uint8_t *block = out + written;
+    uint32_t block_len;
+
+    if (out_len - written < BGZF_MAX_BLOCK)
+      return 0;
+
+    int block_level = adaptive ? adaptive_level(in, block_in, level) : level;
+
+    isal_deflate_stateless_init(&stream);
+    stream.next_in = in;
+    stream.avail_in = block_in;
+    stream.next_out = block + BGZF_HEADER_SIZE;
+    stream.avail_out = BGZF_MAX_BLOCK - BGZF_HEADER_SIZE - BGZF_TRAILER_SIZE;
+    stream.end_of_stream = 1;
+    stream.flush = NO_FLUSH;
+    stream.level = block_level;
+    stream.level_buf = level_buf;
+    stream.level_buf_size = level_size;
+
+    if (block_level >= 0 && isal_deflate_stateless(&stream) == COMP_OK) {
+      block_len = BGZF_HEADER_SIZE + stream.total_out;
+    } else {
+      // Incompressible: a single final stored block always fits
+      block_len = BGZF_HEADER_SIZE +
+                  deflate_stored(in, block_in, block + BGZF_HEADER_SIZE, 1);
+    }
+
+    put_le32(block + block_len, crc32_gzip_refl(0, in, block_in));
+    put_le32(block + block_len + 4, block_in);
+    block_len += BGZF_TRAILER_SIZE;
+
+    memcpy(block, bgzf_eof_block, BGZF_HEADER_SIZE);
+    put_le16(block + 16, block_len - 1); // BSIZE
+    written += block_len;
+    in += block_in;
+    in_len -= block_in;
+  }
+  return written;
+}
+
+/*
+ * One record of a batch as a complete gzip member, or a bare deflate stream
+ * with raw set, in a single stateless call straight into its output.
+ */
+static void compress_record_run(compress_record *record, int level,
+                                uint8_t *level_buf, int level_size, int raw) {
+  struct isal_zstream stream;
+  struct isal_gzip_header gz_hdr;
+
+  record->output_length = 0;
+  if (record->input_length > UINT32_MAX ||
+      record->output_capacity > UINT32_MAX) {
+    record->status = 1;
+    return;
+  }
+
+  isal_deflate_stateless_init(&stream);
+  stream.next_in = record->input;
+  stream.avail_in = record->input_length;
+  stream.next_out = record->output;
+  stream.avail_out = record->output_capacity;
+  stream.end_of_stream = 1;
+  stream.flush = NO_FLUSH;
+  stream.level = level;
+  stream.level_buf = level_buf;
+  stream.level_buf_size = level_size;
+  if (!raw) {
+    isal_gzip_header_init(&gz_hdr);
+    gz_hdr.os = UNIX;
+    stream.gzip_flag = IGZIP_GZIP_NO_HDR;
+    if (isal_write_gzip_header(&stream, &gz_hdr) != COMP_OK) {
+      record->status = BUFFER_TOO_SMALL;
+      return;
+    }
+  }
+
+  if (isal_deflate_stateless(&stream) != COMP_OK) {
+    record->status = BUFFER_TOO_SMALL;
+    return;
+  }
+  record->output_length = stream.total_out;
+  record->status = 0;
+}
+
+#define MIN_JOBQUEUE 16 /* jobs in flight with the default BLOCK_SIZE */
+
 #if defined(HAVE_THREADS)
 
-#define MAX_THREADS 8
-#define MAX_JOBQUEUE 16 /* must be a power of 2 */
+#define WRITER_BATCH 64 /* most completed blocks gathered into one write */
+#define BATCH_JOB_SIZE (256 * 1024) /* record input handed to a worker at once */
 
 enum job_status { JOB_UNALLOCATED = 0, JOB_ALLOCATED, JOB_SUCCESS, JOB_FAIL };
 
@@ -79,312 +471,1051 @@ struct thread_job {
   uint8_t *next_out;
   uint32_t avail_out;
   uint32_t total_out;
+  uint8_t *dict; // preceding input to prime the block with, or NULL
+  uint32_t dict_len;
+  uint32_t crc; // of this block's input, merged by the writer
   uint32_t type;
-  uint32_t status;
+  compress_record *records; // a slice of a batch instead of a block, or NULL
+  size_t record_count;
+  _Atomic uint32_t status;
+  sem_t done; // posted once the job has a final status
+};
+
+struct thread_pool;
+
+// Time one thread spent on jobs in the call in progress
+struct worker_times {
+  uint64_t busy_ns;
+  uint64_t deflate_ns;
+  uint64_t crc_ns;
+};
+
+struct pool_worker {
+  pthread_t thread;
+  struct thread_pool *pool;
+  uint8_t *level_buf; // kept for the lifetime of the pool
+  struct worker_times times;
+  int cpu;  // pinned to, or -1
+  int part; // takes the jobs of this part only
 };
+
+// The jobs of one part of the ring, claimed in order by its workers
+struct pool_part {
+  sem_t pending;
+  _Atomic uint64_t queue; // jobs of the part claimed so far
+  int *slots;             // ring slots of the part, ascending
+  int nslots;
+  int nworkers;
+};
+
+/*
+ * Single producer, multi consumer job ring doubling as the reorder buffer.
+ * Jobs are addressed by ever increasing sequence numbers: the producer
+ * publishes up to head, workers claim with an atomic increment of the queue
+ * of their part, and the writer thread retires them in order up to tail.
+ * Everybody blocks on semaphores rather than a shared mutex: idle workers on
+ * pending, the writer on the done semaphore of the next job in order, the
+ * producer on free_slots.
+ *
+ * With NUMA placement the ring is split into parts, one per node: slot s and
+ * its output area belong to part slot_part[s] and only the workers on that
+ * node take its jobs, so each block is written where it is compressed. A
+ * part gets slots in proportion to its workers, interleaved over the ring.
+ * Without it there is a single part.
+ */
 struct thread_pool {
-  pthread_t threads[MAX_THREADS];
-  struct thread_job job[MAX_JOBQUEUE];
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  int head;
-  int tail;
-  int queue;
-  int shutdown;
+  struct pool_worker *workers;
+  int nthreads;
+  int level;
+  int level_size;
+  struct thread_job *job;
+  uint64_t queue_size; // power of 2
+  _Atomic uint64_t head;
+  struct pool_part *parts;
+  int nparts; // power of 2, at most queue_size
+  int *slot_part; // part of each slot
+  int *cpu_part;  // part of the node of each CPU, -1 without; NULL for 1 part
+  uint64_t tail; // owned by the writer
+  sem_t free_slots;
+  pthread_t writer;
+  struct compress_sink *sink; // destination of the call in progress
+  int flags;
+  uint32_t crc;      // running CRC of the retired blocks, owned by the writer
+  uint64_t total_in; // input length of the retired blocks
+  uint64_t total_out; // bytes written so far, header included
+  gzip_index *index;  // checkpoints recorded at block boundaries, or NULL
+  struct worker_times producer; // jobs the producer ran itself
+  uint64_t stall_ns;  // producer blocked on a free slot
+  uint64_t jobs;      // published since pool_begin
+  _Atomic int failed;
+  _Atomic int shutdown;
 };
 
-// Globals for thread pool
-struct thread_pool pool;
+static inline struct thread_job *pool_job(struct thread_pool *pool,
+                                          uint64_t seq) {
+  return &pool->job[seq & (pool->queue_size - 1)];
+}
 
-static inline int pool_has_space() {
-  return ((pool.head + 1) % MAX_JOBQUEUE) != pool.tail;
+/*
+ * Jobs are published in sequence and every lap of the ring visits the slots
+ * of a part in the same order, so its k-th job follows from k alone.
+ */
+uint64_t pool_get_work(struct thread_pool *pool, int part) {
+  struct pool_part *p = &pool->parts[part];
+  uint64_t k = atomic_fetch_add_explicit(&p->queue, 1, memory_order_acq_rel);
+  return k / p->nslots * pool->queue_size + p->slots[k % p->nslots];
 }
 
-static inline int pool_has_work() { return (pool.queue != pool.head); }
+static inline sem_t *pool_pending(struct thread_pool *pool, uint64_t seq) {
+  return &pool->parts[pool->slot_part[seq & (pool->queue_size - 1)]].pending;
+}
 
-int pool_get_work() {
-  assert(pool.queue != pool.head);
-  pool.queue = (pool.queue + 1) % MAX_JOBQUEUE;
-  return pool.queue;
+// Part of the node the caller runs on, -1 when that node has no workers
+static int pool_local_part(struct thread_pool *pool) {
+  int cpu;
+  if (pool->cpu_part == NULL)
+    return 0;
+  cpu = sched_getcpu();
+  return cpu >= 0 && cpu < CPU_SETSIZE ? pool->cpu_part[cpu] : -1;
 }
 
-int pool_put_work(struct isal_zstream *stream) {
-  pthread_mutex_lock(&pool.mutex);
-  if (!pool_has_space() || pool.shutdown) {
-    pthread_mutex_unlock(&pool.mutex);
-    return 1;
-  }
-  int idx = (pool.head + 1) % MAX_JOBQUEUE;
-  pool.job[idx].next_in = stream->next_in;
-  pool.job[idx].avail_in = stream->avail_in;
-  pool.job[idx].next_out = stream->next_out;
-  pool.job[idx].avail_out = stream->avail_out;
-  pool.job[idx].status = JOB_ALLOCATED;
-  pool.job[idx].type = stream->end_of_stream == 0 ? 0 : 1;
-  pool.head = idx;
-  pthread_cond_signal(&pool.cond);
-  pthread_mutex_unlock(&pool.mutex);
-  return 0;
+// Settle a job, its times are in before the writer can see it
+static void pool_job_done(struct thread_job *job, uint32_t status,
+                          struct worker_times *times, uint64_t start) {
+  times->busy_ns += igzip_clock_ns() - start;
+  atomic_store_explicit(&job->status, status, memory_order_release);
+  sem_post(&job->done);
 }
 
-void *thread_worker(void *arg) {
-  int compress_level = *((int *)arg);
-  struct isal_zstream wstream;
+int pool_run_job(struct thread_pool *pool, uint64_t seq, uint8_t *level_buf,
+                 struct worker_times *times) {
+  struct thread_job *job = pool_job(pool, seq);
+  uint64_t start = igzip_clock_ns(), t;
   int check;
-  int work_idx;
-  int level = compress_level;
-  int level_size = level_size_buf[level];
-  uint8_t *level_buf = (uint8_t *)malloc_safe(level_size);
-  log_print(VERBOSE, "Start worker, compress level %d\n", compress_level);
-
-  while (!pool.shutdown) {
-    pthread_mutex_lock(&pool.mutex);
-    while (!pool_has_work() && !pool.shutdown) {
-      pthread_cond_wait(&pool.cond, &pool.mutex);
-    }
-    if (pool.shutdown) {
-      pthread_mutex_unlock(&pool.mutex);
-      continue;
+
+  if (job->records != NULL) {
+    size_t i;
+    TRACE_BEGIN(TRACE_DEFLATE, job->record_count);
+    for (i = 0; i < job->record_count; i++)
+      compress_record_run(&job->records[i], pool->level, level_buf,
+                          pool->level_size, pool->flags & COMPRESS_RAW);
+    TRACE_END(TRACE_DEFLATE);
+    job->crc = 0;
+    job->total_out = 0; // records went to their own outputs
+    times->deflate_ns += igzip_clock_ns() - start;
+    pool_job_done(job, JOB_SUCCESS, times, start);
+    return 0;
+  }
+
+  TRACE_BEGIN(TRACE_DEFLATE, job->avail_in);
+  if (pool->flags & COMPRESS_BGZF) {
+    job->total_out =
+        bgzf_compress(job->next_in, job->avail_in, job->next_out,
+                      job->avail_out, pool->level, level_buf, pool->level_size,
+                      pool->flags & COMPRESS_ADAPTIVE);
+    TRACE_END(TRACE_DEFLATE);
+    check = job->avail_in > 0 && job->total_out == 0;
+    job->crc = 0; // every block carries its own trailer
+    times->deflate_ns += igzip_clock_ns() - start;
+    pool_job_done(job, JOB_SUCCESS + check, times, start);
+    return check;
+  }
+
+  uint32_t total_out = 0;
+  check = deflate_block(job->next_in, job->avail_in, job->next_out,
+                        job->avail_out, job->dict, job->dict_len, job->type,
+                        pool->level, level_buf, pool->level_size,
+                        pool->flags & COMPRESS_ADAPTIVE, &total_out);
+  TRACE_END(TRACE_DEFLATE);
+  log_print(VERBOSE, "Finished job %llu, out=%u\n", (unsigned long long)seq,
+            total_out);
+
+  t = igzip_clock_ns();
+  times->deflate_ns += t - start;
+  TRACE_BEGIN(TRACE_CRC, job->avail_in);
+  job->crc = crc32_gzip_refl(0, job->next_in, job->avail_in);
+  TRACE_END(TRACE_CRC);
+  times->crc_ns += igzip_clock_ns() - t;
+  job->total_out = total_out;
+  pool_job_done(job, JOB_SUCCESS + (check != 0), times,
+                start); // complete or fail
+  return check;
+}
+
+/*
+ * Take a free queue slot for the next job. While the ring is full the
+ * producer compresses pending jobs itself, and only sleeps once there is
+ * nothing left to pick up. It takes only the jobs of its own node, whose
+ * output pages belong there.
+ */
+void pool_reserve_slot(struct thread_pool *pool, uint8_t *level_buf) {
+  while (sem_trywait(&pool->free_slots) != 0) {
+    int part = pool_local_part(pool);
+    if (part >= 0 && sem_trywait(&pool->parts[part].pending) == 0) {
+      pool_run_job(pool, pool_get_work(pool, part), level_buf,
+                   &pool->producer);
+    } else {
+      uint64_t start = igzip_clock_ns();
+      TRACE_BEGIN(TRACE_STALL, atomic_load_explicit(&pool->head,
+                                                    memory_order_relaxed));
+      while (sem_wait(&pool->free_slots) != 0)
+        ;
+      TRACE_END(TRACE_STALL);
+      pool->stall_ns += igzip_clock_ns() - start;
+      return;
     }
+  }
+}
 
-    work_idx = pool_get_work();
-    pthread_cond_signal(&pool.cond);
-    pthread_mutex_unlock(&pool.mutex);
+// Publish a job into a slot taken with pool_reserve_slot
+void pool_put_work(struct thread_pool *pool, struct isal_zstream *stream,
+                   uint8_t *dict, uint32_t dict_len) {
+  uint64_t seq = atomic_load_explicit(&pool->head, memory_order_relaxed);
+  struct thread_job *job = pool_job(pool, seq);
+  TRACE_BEGIN(TRACE_SUBMIT, seq);
+  job->next_in = stream->next_in;
+  job->avail_in = stream->avail_in;
+  job->next_out = stream->next_out;
+  job->avail_out = stream->avail_out;
+  job->dict = dict;
+  job->dict_len = dict_len;
+  job->type = stream->end_of_stream == 0 ? 0 : 1;
+  job->records = NULL;
+  pool->jobs++;
+  atomic_store_explicit(&job->status, JOB_ALLOCATED, memory_order_relaxed);
+  atomic_store_explicit(&pool->head, seq + 1, memory_order_release);
+  sem_post(pool_pending(pool, seq));
+  TRACE_END(TRACE_SUBMIT);
+}
 
-    isal_deflate_stateless_init(&wstream);
-    wstream.next_in = pool.job[work_idx].next_in;
-    wstream.next_out = pool.job[work_idx].next_out;
-    wstream.avail_in = pool.job[work_idx].avail_in;
-    wstream.avail_out = pool.job[work_idx].avail_out;
-    wstream.end_of_stream = pool.job[work_idx].type;
-    wstream.flush = FULL_FLUSH;
-    wstream.level = compress_level;
-    wstream.level_buf = level_buf;
-    wstream.level_buf_size = level_size;
+// Publish a slice of batch records into a slot taken with pool_reserve_slot
+void pool_put_records(struct thread_pool *pool, compress_record *records,
+                      size_t count) {
+  uint64_t seq = atomic_load_explicit(&pool->head, memory_order_relaxed);
+  struct thread_job *job = pool_job(pool, seq);
+  TRACE_BEGIN(TRACE_SUBMIT, seq);
+  job->avail_in = 0;
+  job->records = records;
+  job->record_count = count;
+  pool->jobs++;
+  atomic_store_explicit(&job->status, JOB_ALLOCATED, memory_order_relaxed);
+  atomic_store_explicit(&pool->head, seq + 1, memory_order_release);
+  sem_post(pool_pending(pool, seq));
+  TRACE_END(TRACE_SUBMIT);
+}
 
-    check = isal_deflate_stateless(&wstream);
-    log_print(VERBOSE, "Worker finished job %d, out=%d\n", work_idx,
-              wstream.total_out);
+// Wait until the writer has retired every published job
+void pool_drain(struct thread_pool *pool, uint8_t *level_buf) {
+  uint64_t i;
+  for (i = 0; i < pool->queue_size; i++)
+    pool_reserve_slot(pool, level_buf);
+  for (i = 0; i < pool->queue_size; i++)
+    sem_post(&pool->free_slots);
+}
+
+// Point the pool at the destination of a new gzip stream
+void pool_begin(struct thread_pool *pool, struct compress_sink *sink,
+                int flags, uint64_t header_len, gzip_index *index) {
+  int i;
+
+  // Blocks go out through the writer thread as soon as they are in order
+  pool->sink = sink;
+  pool->flags = flags;
+  pool->crc = 0;
+  pool->total_in = 0;
+  pool->total_out = header_len;
+  pool->index = index;
+  // Workers are idle between calls, their times start over too
+  for (i = 0; i < pool->nthreads; i++)
+    memset(&pool->workers[i].times, 0, sizeof(struct worker_times));
+  memset(&pool->producer, 0, sizeof(struct worker_times));
+  pool->stall_ns = 0;
+  pool->jobs = 0;
+  atomic_store(&pool->failed, 0);
+}
+
+// Add the times of a drained pool to stats, the producer last
+void pool_collect(struct thread_pool *pool, igzip_stats *stats) {
+  int i;
+  for (i = 0; i <= pool->nthreads; i++) {
+    struct worker_times *t =
+        i < pool->nthreads ? &pool->workers[i].times : &pool->producer;
+    stats->deflate_ns += t->deflate_ns;
+    stats->crc_ns += t->crc_ns;
+    igzip_stats_busy(stats, i, t->busy_ns);
+  }
+  stats->stall_ns += pool->stall_ns;
+  stats->jobs += pool->jobs;
+}
+
+// Close the stream once drained: BGZF EOF block or the gzip trailer
+void pool_end(struct thread_pool *pool) {
+  if (pool->flags & COMPRESS_BGZF) {
+    sink_write(pool->sink, bgzf_eof_block, sizeof(bgzf_eof_block));
+  } else {
+    sink_write(pool->sink, &pool->crc, sizeof(uint32_t));
+    sink_write(pool->sink, &pool->total_in, sizeof(uint32_t));
+  }
+}
+
+void *thread_worker(void *arg) {
+  struct pool_worker *worker = (struct pool_worker *)arg;
+  struct thread_pool *pool = worker->pool;
+  log_print(VERBOSE, "Start worker, compress level %d\n", pool->level);
+  TRACE_NAME("worker");
+  // A pinned worker allocates its own state, so it is on its node
+  if (worker->level_buf == NULL)
+    worker->level_buf = (uint8_t *)cache_alloc(pool->level_size);
 
-    pool.job[work_idx].total_out = wstream.total_out;
-    pool.job[work_idx].status = JOB_SUCCESS + check; // complete or fail
-    if (check)
+  for (;;) {
+    // One post per published job, so a successful wait owns exactly one
+    while (sem_wait(&pool->parts[worker->part].pending) != 0)
+      ;
+    if (atomic_load(&pool->shutdown))
       break;
+
+    // A failed job is reported through its status, the worker stays alive
+    pool_run_job(pool, pool_get_work(pool, worker->part), worker->level_buf,
+                 &worker->times);
   }
-  free(level_buf);
   log_print(VERBOSE, "Worker quit\n");
   pthread_exit(NULL);
 }
 
-int pool_create(int thread_num_in_total, int *compress_level) {
+/*
+ * Retire the jobs from tail in order. Blocks that are already complete
+ * behind the one waited for join the same batch, so a burst of finished
+ * jobs reaches the sink as a single gathered write.
+ */
+void *thread_writer(void *arg) {
+  struct thread_pool *pool = (struct thread_pool *)arg;
+  struct iovec iov[WRITER_BATCH];
+
+  TRACE_NAME("writer");
+  for (;;) {
+    struct thread_job *job = pool_job(pool, pool->tail);
+    // Completion order is arbitrary, wait for the next block in sequence
+    TRACE_BEGIN(TRACE_WAIT, pool->tail);
+    while (sem_wait(&job->done) != 0)
+      ;
+    TRACE_END(TRACE_WAIT);
+    if (atomic_load(&pool->shutdown))
+      break;
+
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+    int i, n = 1;
+    while (n < WRITER_BATCH && pool->tail + n < head &&
+           sem_trywait(&pool_job(pool, pool->tail + n)->done) == 0)
+      n++;
+
+    int cnt = 0;
+    for (i = 0; i < n; i++) {
+      job = pool_job(pool, pool->tail + i);
+      uint32_t status =
+          atomic_load_explicit(&job->status, memory_order_acquire);
+      if (status > JOB_SUCCESS && !atomic_load(&pool->failed)) {
+        atomic_store(&pool->failed, 1);
+        // a batch has no sink, its records report their own status
+        if (pool->sink != NULL)
+          log_print(ERROR,
+                    "igzip: Error encountered while compressing to %s\n",
+                    pool->sink->name);
+        else
+          log_print(ERROR, "igzip: Error encountered in a record batch\n");
+      }
+      // After a failure keep retiring so the producer can drain the ring
+      if (!atomic_load(&pool->failed)) {
+        // Every block starts byte aligned with history only from its dict
+        if (pool->index != NULL)
+          gzip_index_add_point(pool->index, pool->total_out, pool->total_in,
+                               job->dict, job->dict_len,
+                               pool->flags & COMPRESS_BGZF);
+        iov[cnt].iov_base = job->next_out;
+        iov[cnt].iov_len = job->total_out;
+        cnt++;
+        pool->total_out += job->total_out;
+      }
+      pool->crc = crc32_gzip_combine(pool->crc, job->crc, job->avail_in);
+      pool->total_in += job->avail_in;
+    }
+    if (cnt > 0 && pool->sink != NULL && sink_writev(pool->sink, iov, cnt))
+      atomic_store(&pool->failed, 1); // caller's buffer is full
+
+    // The slots go back only once their output has been written
+    for (i = 0; i < n; i++) {
+      job = pool_job(pool, pool->tail);
+      job->total_out = 0;
+      atomic_store_explicit(&job->status, JOB_UNALLOCATED,
+                            memory_order_relaxed);
+      pool->tail++;
+      sem_post(&pool->free_slots);
+    }
+  }
+  log_print(VERBOSE, "Writer quit\n");
+  pthread_exit(NULL);
+}
+
+/*
+ * Where the workers run. With a CPU list worker i is pinned to its i-th CPU,
+ * round robin. With numa the CPUs, those the process may run on by default,
+ * are dealt a node at a time in turn and the workers of a node make up a
+ * part. Parts are a power of 2, so with an odd number of nodes some share
+ * one. Returns 1 on a malformed list.
+ */
+static int pool_place(struct thread_pool *pool, const char *cpu_list,
+                      int numa) {
+  int *cpus, *order, *where, *node = NULL, nodes[CPU_SETSIZE];
+  int ncpus = 0, nnodes = 1, i, k, r, n;
+
+  pool->nparts = 1;
+  pool->cpu_part = NULL;
+  for (i = 0; i < pool->nthreads; i++) {
+    pool->workers[i].cpu = -1;
+    pool->workers[i].part = 0;
+  }
+  if (cpu_list == NULL && !numa)
+    return 0;
+
+  cpus = (int *)malloc_safe(CPU_SETSIZE * sizeof(int));
+  if (cpu_list != NULL) {
+    ncpus = parse_cpu_list(cpu_list, cpus, CPU_SETSIZE);
+    for (i = 0; i < ncpus; i++)
+      if (cpus[i] >= CPU_SETSIZE)
+        ncpus = -1; // checked by compress_ctx_create_opts already
+  } else {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (i = 0; i < CPU_SETSIZE; i++)
+      if (CPU_ISSET(i, &allowed))
+        cpus[ncpus++] = i;
+  }
+  if (ncpus <= 0) {
+    igzip_free(cpus);
+    return 1;
+  }
+
+  order = (int *)malloc_safe(ncpus * sizeof(int));
+  where = (int *)malloc_safe(ncpus * sizeof(int));
+  if (numa) {
+    node = (int *)malloc_safe(CPU_SETSIZE * sizeof(int));
+    cpu_nodes(node, CPU_SETSIZE);
+    // The nodes of the listed CPUs, ascending
+    nnodes = 0;
+    for (i = 0; i < ncpus; i++) {
+      for (k = 0; k < nnodes && nodes[k] < node[cpus[i]]; k++)
+        ;
+      if (k == nnodes || nodes[k] != node[cpus[i]]) {
+        memmove(nodes + k + 1, nodes + k, (nnodes - k) * sizeof(int));
+        nodes[k] = node[cpus[i]];
+        nnodes++;
+      }
+    }
+    // Round r deals the r-th CPU of every node
+    for (r = 0, n = 0; n < ncpus; r++) {
+      for (k = 0; k < nnodes; k++) {
+        int seen = 0;
+        for (i = 0; i < ncpus; i++) {
+          if (node[cpus[i]] == nodes[k] && seen++ == r) {
+            order[n] = cpus[i];
+            where[n++] = k;
+            break;
+          }
+        }
+      }
+    }
+  } else {
+    for (n = 0; n < ncpus; n++) {
+      order[n] = cpus[n];
+      where[n] = 0;
+    }
+  }
+
+  // The first round puts a worker on every node in use, so no part is empty
+  n = nnodes < pool->nthreads ? nnodes : pool->nthreads;
+  while (pool->nparts * 2 <= n)
+    pool->nparts <<= 1;
+  for (i = 0; i < pool->nthreads; i++) {
+    pool->workers[i].cpu = order[i % ncpus];
+    pool->workers[i].part = where[i % ncpus] & (pool->nparts - 1);
+  }
+  if (pool->nparts > 1) {
+    // Any CPU on a node in use, for the producer to find its part
+    pool->cpu_part = (int *)malloc_safe(CPU_SETSIZE * sizeof(int));
+    for (i = 0; i < CPU_SETSIZE; i++) {
+      pool->cpu_part[i] = -1;
+      for (k = 0; k < nnodes; k++)
+        if (node[i] == nodes[k])
+          pool->cpu_part[i] = k & (pool->nparts - 1);
+    }
+  }
+  igzip_free(node);
+  igzip_free(cpus);
+  igzip_free(order);
+  igzip_free(where);
+  return 0;
+}
+
+/*
+ * Deal the ring slots to the parts by their worker counts, smooth weighted
+ * round robin: each slot goes to the part furthest behind its share, so the
+ * slots of a part are spread over the ring rather than bunched. The ring
+ * holds a slot per worker, so every part gets at least one.
+ */
+static void pool_deal_slots(struct thread_pool *pool) {
+  int *credit = (int *)malloc_safe(pool->nparts * sizeof(int));
+  int i, best, total = 0;
+  uint64_t s;
+
+  for (i = 0; i < pool->nparts; i++) {
+    credit[i] = 0;
+    total += pool->parts[i].nworkers;
+  }
+  pool->slot_part = (int *)malloc_safe(pool->queue_size * sizeof(int));
+  for (s = 0; s < pool->queue_size; s++) {
+    best = 0;
+    for (i = 0; i < pool->nparts; i++) {
+      credit[i] += pool->parts[i].nworkers;
+      if (credit[i] > credit[best])
+        best = i;
+    }
+    credit[best] -= total;
+    pool->slot_part[s] = best;
+    pool->parts[best].slots[pool->parts[best].nslots++] = (int)s;
+  }
+  igzip_free(credit);
+}
+
+int pool_create(struct thread_pool *pool, int thread_num_in_total,
+                int compress_level, int queue_depth, const char *cpus,
+                int numa) {
   int i;
   int nthreads = thread_num_in_total - 1;
-  pool.head = 0;
-  pool.tail = 0;
-  pool.queue = 0;
-  pool.shutdown = 0;
+
+  pool->nthreads = nthreads;
+  pool->workers = (struct pool_worker *)malloc_safe(
+      nthreads * sizeof(struct pool_worker));
+  if (pool_place(pool, cpus, numa)) {
+    igzip_free(pool->workers);
+    return 1;
+  }
+
+  // Split in parts, the ring needs a slot for every worker to share fairly
+  pool->queue_size = 2;
+  while (pool->queue_size < (uint64_t)queue_depth ||
+         (pool->nparts > 1 && pool->queue_size < (uint64_t)nthreads))
+    pool->queue_size <<= 1;
+
+  pool->job = (struct thread_job *)malloc_safe(pool->queue_size *
+                                               sizeof(struct thread_job));
+  for (i = 0; i < (int)pool->queue_size; i++) {
+    atomic_init(&pool->job[i].status, JOB_UNALLOCATED);
+    pool->job[i].records = NULL;
+    sem_init(&pool->job[i].done, 0, 0);
+  }
+  pool->parts = (struct pool_part *)malloc_safe(pool->nparts *
+                                                sizeof(struct pool_part));
+  for (i = 0; i < pool->nparts; i++) {
+    sem_init(&pool->parts[i].pending, 0, 0);
+    atomic_init(&pool->parts[i].queue, 0);
+    pool->parts[i].slots = (int *)malloc_safe(pool->queue_size * sizeof(int));
+    pool->parts[i].nslots = 0;
+    pool->parts[i].nworkers = 0;
+  }
   for (i = 0; i < nthreads; i++)
-    pthread_create(&pool.threads[i], NULL, thread_worker,
-                   (void *)compress_level);
+    pool->parts[pool->workers[i].part].nworkers++;
+  pool_deal_slots(pool);
+  atomic_init(&pool->head, 0);
+  pool->tail = 0;
+  pool->sink = NULL;
+  pool->flags = 0;
+  pool->crc = 0;
+  pool->total_in = 0;
+  pool->total_out = 0;
+  pool->index = NULL;
+  memset(&pool->producer, 0, sizeof(struct worker_times));
+  pool->stall_ns = 0;
+  pool->jobs = 0;
+  atomic_init(&pool->failed, 0);
+  atomic_init(&pool->shutdown, 0);
+  pool->level = compress_level;
+  pool->level_size = level_buf_size(compress_level);
+  sem_init(&pool->free_slots, 0, pool->queue_size);
+  for (i = 0; i < nthreads; i++) {
+    struct pool_worker *worker = &pool->workers[i];
+    pthread_attr_t attr;
+    worker->pool = pool;
+    worker->level_buf = NULL;
+    if (worker->cpu < 0)
+      worker->level_buf = (uint8_t *)cache_alloc(pool->level_size);
+    memset(&worker->times, 0, sizeof(struct worker_times));
+    pthread_attr_init(&attr);
+    if (worker->cpu >= 0) {
+      // Started on its CPU, so its stack and buffers are local from the start
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(worker->cpu, &set);
+      pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    if (pthread_create(&worker->thread, &attr, thread_worker,
+                       (void *)worker) != 0) {
+      log_print(WARN, "igzip: Cannot pin a worker to CPU %d\n", worker->cpu);
+      worker->cpu = -1;
+      pthread_create(&worker->thread, NULL, thread_worker, (void *)worker);
+    }
+    pthread_attr_destroy(&attr);
+  }
+  pthread_create(&pool->writer, NULL, thread_writer, (void *)pool);
 
-  log_print(VERBOSE, "Created %d pool threads\n", nthreads);
+  log_print(VERBOSE, "Created %d pool threads, queue depth %llu, %d parts\n",
+            nthreads, (unsigned long long)pool->queue_size, pool->nparts);
   return 0;
 }
 
-void pool_quit(int thread_num_in_total) {
+void pool_quit(struct thread_pool *pool) {
   int i;
-  pthread_mutex_lock(&pool.mutex);
-  pool.shutdown = 1;
-  pthread_mutex_unlock(&pool.mutex);
-  pthread_cond_broadcast(&pool.cond);
-  for (i = 0; i < thread_num_in_total - 1; i++)
-    pthread_join(pool.threads[i], NULL);
-  log_print(VERBOSE, "Deleted %d pool threads\n", i);
+  atomic_store(&pool->shutdown, 1);
+  for (i = 0; i < pool->nthreads; i++)
+    sem_post(&pool->parts[pool->workers[i].part].pending);
+  // The idle writer is parked on the next job in sequence
+  sem_post(&pool_job(pool, pool->tail)->done);
+  pthread_join(pool->writer, NULL);
+  for (i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    cache_free(pool->workers[i].level_buf, pool->level_size);
+  }
+  for (i = 0; i < (int)pool->queue_size; i++)
+    sem_destroy(&pool->job[i].done);
+  for (i = 0; i < pool->nparts; i++) {
+    sem_destroy(&pool->parts[i].pending);
+    igzip_free(pool->parts[i].slots);
+  }
+  sem_destroy(&pool->free_slots);
+  igzip_free(pool->workers);
+  igzip_free(pool->parts);
+  igzip_free(pool->slot_part);
+  igzip_free(pool->cpu_part);
+  igzip_free(pool->job);
+  log_print(VERBOSE, "Deleted %d pool threads\n", pool->nthreads);
 }
 
 #endif // defined(HAVE_THREADS)
 
+struct _compress_ctx {
+  int level;
+  int thread_num;
+  int flags;
+  size_t block_size;   // input per parallel job
+  size_t job_out_size; // output area per queue slot
+  size_t io_size;      // async I/O buffer size
+  int io_depth;
+  unsigned char *outbuf; // one block_size area, then one per queue slot
+  size_t outbuf_size;
+  int outbuf_mapped; // fresh pages, placed on the node that writes them
+  unsigned char *level_buf;
+  int level_size;
+  gzip_index *index;
+  igzip_stats *stats; // filled by every call, or NULL
+#if defined(HAVE_THREADS)
+  struct thread_pool pool;
+#endif
+};
+
 inline int ustr_eof(string_with_head *str, size_t full_length) {
   return str->offset == full_length;
 }
 
-inline size_t ustrncpy(unsigned char *dst, string_with_head *src, size_t num,
+inline size_t ustrnext(uint8_t **dst, string_with_head *src, size_t num,
                        size_t full_length) {
   if (full_length - src->offset < num) {
     num = full_length - src->offset;
   }
-  unsigned char *head = src->data + src->offset;
-  for (size_t i = 0; i < num; ++i) {
-    dst[i] = *(head + i);
-  }
+  // hand out the caller's bytes in place instead of copying them
+  *dst = src->data + src->offset;
   src->offset += num;
   return num;
 }
 
-int compress_file(unsigned char *input_string, size_t input_length,
-                  const char *outfile_name, int compress_level,
-                  int thread_num) {
-  FILE *out = NULL;
-  unsigned char *inbuf = NULL, *outbuf = NULL, *level_buf = NULL;
-  size_t inbuf_size, outbuf_size;
-  int level_size = 0;
-  struct isal_zstream stream;
-  struct isal_gzip_header gz_hdr;
-  int ret, success = 0;
-  string_with_head input;
-  input.data = input_string;
-  input.offset = 0;
-  string_with_head *input_ptr = &input;
+#if defined(HAVE_THREADS)
+// CPUs in a list workers can be pinned to, -1 if it is malformed
+static int cpu_list_count(const char *list) {
+  int *cpus = (int *)malloc_safe(CPU_SETSIZE * sizeof(int));
+  int i, n = parse_cpu_list(list, cpus, CPU_SETSIZE);
+  for (i = 0; i < n; i++)
+    if (cpus[i] >= CPU_SETSIZE)
+      n = -1;
+  igzip_free(cpus);
+  return n;
+}
+#endif
 
-  int level = compress_level;
+void igzip_options_init(igzip_options *opts) {
+  memset(opts, 0, sizeof(igzip_options));
+  opts->level = 1;
+}
 
-  if (input_string == NULL)
-    goto compress_file_cleanup;
+void igzip_options_tune(igzip_options *opts, size_t input_length) {
+  int auto_threads = opts->thread_num < 1;
+  size_t blocks;
 
-  open_out_file(&out, outfile_name);
-  if (out == NULL)
-    goto compress_file_cleanup;
+  if (auto_threads) {
+#if defined(HAVE_THREADS)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts->cpus != NULL)
+      cores = cpu_list_count(opts->cpus); // one per listed CPU
+    opts->thread_num = cores > 1 ? (int)cores : 1;
+#else
+    opts->thread_num = 1;
+#endif
+  }
+
+  if (opts->block_size == 0) {
+    // Around four blocks per thread, so small inputs still spread out
+    opts->block_size = MIN_BLOCK_SIZE;
+    if (input_length == SIZE_MAX)
+      opts->block_size = BLOCK_SIZE;
+    else
+      while (opts->block_size < MAX_BLOCK_SIZE &&
+             opts->block_size * 4 * opts->thread_num < input_length)
+        opts->block_size <<= 1;
+  } else if (opts->block_size < MIN_BLOCK_SIZE) {
+    opts->block_size = MIN_BLOCK_SIZE;
+  } else if (opts->block_size > MAX_BLOCK_SIZE) {
+    opts->block_size = MAX_BLOCK_SIZE;
+  }
 
-  inbuf_size = BLOCK_SIZE;
-  outbuf_size = BLOCK_SIZE;
+  // No more threads than blocks to hand them
+  if (auto_threads && input_length != SIZE_MAX) {
+    blocks = (input_length + opts->block_size - 1) / opts->block_size;
+    if (blocks < (size_t)opts->thread_num)
+      opts->thread_num = blocks > 1 ? (int)blocks : 1;
+  }
+
+  if (opts->queue_depth < 1) {
+    // The bytes in flight of MIN_JOBQUEUE default blocks, two jobs per thread
+    size_t depth = MIN_JOBQUEUE * (size_t)BLOCK_SIZE / opts->block_size;
+    if (depth < 2 * (size_t)opts->thread_num)
+      depth = 2 * (size_t)opts->thread_num;
+    opts->queue_depth = (int)depth;
+  }
 
+  if (opts->io_buffer_size == 0)
+    opts->io_buffer_size = opts->block_size;
+  opts->io_buffer_size = (opts->io_buffer_size + DIRECT_IO_ALIGN - 1) &
+                         ~(size_t)(DIRECT_IO_ALIGN - 1);
+  if (opts->io_depth < 1)
+    opts->io_depth = ASYNC_IO_DEPTH;
+}
+
+compress_ctx *compress_ctx_create_opts(const igzip_options *options) {
+  compress_ctx *ctx;
+  igzip_options opts = *options;
+
+  if (opts.level < 0 || opts.level > ISAL_DEF_MAX_LEVEL) {
+    log_print(ERROR, "igzip: Invalid compression level %d\n", opts.level);
+    return NULL;
+  }
+
+#if !defined(HAVE_THREADS)
+  if (opts.thread_num > 1) {
+    log_print(WARN, "igzip: No compiled threading support but asked for "
+                    "threads > 1, falling back to single thread\n");
+    opts.thread_num = 1;
+  }
+#else
+  if (opts.cpus != NULL && cpu_list_count(opts.cpus) <= 0) {
+    log_print(ERROR, "igzip: Invalid CPU list %s\n", opts.cpus);
+    return NULL;
+  }
+#endif
+  igzip_options_tune(&opts, SIZE_MAX);
+
+  ctx = (compress_ctx *)malloc_safe(sizeof(compress_ctx));
+  ctx->level = opts.level;
+  ctx->thread_num = opts.thread_num;
+  ctx->flags = 0;
+  ctx->index = NULL;
+  ctx->stats = opts.stats;
+  ctx->block_size = opts.block_size;
+  // room for a block even when deflate expands it or BGZF frames it
+  ctx->job_out_size = 2 * opts.block_size;
+  ctx->io_size = opts.io_buffer_size;
+  ctx->io_depth = opts.io_depth;
+  ctx->outbuf_size = opts.block_size;
+  ctx->outbuf_mapped = 0;
 #if defined(HAVE_THREADS)
-  if (thread_num > 1) {
-    if (thread_num > MAX_THREADS) {
-      log_print(WARN, "igzip: compression only supports %d threads at most",
-                MAX_THREADS);
-      thread_num = MAX_THREADS;
+  if (ctx->thread_num > 1) {
+    if (pool_create(&ctx->pool, ctx->thread_num, ctx->level,
+                    opts.queue_depth, opts.cpus, opts.numa)) {
+      log_print(ERROR, "igzip: No CPU to place the workers on\n");
+      igzip_free(ctx);
+      return NULL;
+    }
+    // one output area per queue slot
+    ctx->outbuf_size += ctx->job_out_size * ctx->pool.queue_size;
+    // A recycled buffer has its pages placed already, the slot areas of
+    // other nodes would stay remote
+    ctx->outbuf_mapped = ctx->pool.nparts > 1;
+  }
+#endif
+  if (ctx->outbuf_mapped) {
+    ctx->outbuf = (unsigned char *)mmap(NULL, ctx->outbuf_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ctx->outbuf == MAP_FAILED) {
+      log_print(ERROR, "igzip: Failed to allocate memory\n");
+      exit(MALLOC_FAILED);
     }
-    inbuf_size += (BLOCK_SIZE * MAX_JOBQUEUE);
-    outbuf_size += (BLOCK_SIZE * MAX_JOBQUEUE * 2);
-    pool_create(thread_num, &compress_level);
+  } else {
+    ctx->outbuf = (unsigned char *)cache_alloc(ctx->outbuf_size);
+  }
+  ctx->level_size = level_buf_size(ctx->level);
+  ctx->level_buf = (unsigned char *)cache_alloc(ctx->level_size);
+
+  if (compress_ctx_set_flags(ctx, opts.flags) != 0) {
+    compress_ctx_destroy(ctx);
+    return NULL;
   }
+  return ctx;
+}
+
+compress_ctx *compress_ctx_create(int compress_level, int thread_num) {
+  igzip_options opts;
+  igzip_options_init(&opts);
+  opts.level = compress_level;
+  opts.thread_num = thread_num < 1 ? 1 : thread_num;
+  opts.block_size = BLOCK_SIZE;
+  return compress_ctx_create_opts(&opts);
+}
+
+int compress_ctx_set_flags(compress_ctx *ctx, int flags) {
+  if (ctx == NULL ||
+      (flags & ~(COMPRESS_DICT_CHAIN | COMPRESS_BGZF | COMPRESS_DIRECT_IO |
+                 COMPRESS_RAW | COMPRESS_ADAPTIVE)) != 0)
+    return 1;
+  ctx->flags = flags;
+  return 0;
+}
+
+int compress_ctx_set_index(compress_ctx *ctx, gzip_index *index) {
+  if (ctx == NULL)
+    return 1;
+  ctx->index = index;
+  return 0;
+}
+
+int compress_ctx_set_stats(compress_ctx *ctx, igzip_stats *stats) {
+  if (ctx == NULL)
+    return 1;
+  ctx->stats = stats;
+  return 0;
+}
+
+// End the accounting of a call; without the pool the caller did all the work
+static void compress_stats_end(compress_ctx *ctx, igzip_stats *stats,
+                               uint64_t begin) {
+  if (stats->worker_count == 0)
+    igzip_stats_busy(stats, 0, stats->deflate_ns + stats->crc_ns);
+  stats->total_ns = igzip_clock_ns() - begin;
+  igzip_stats_commit(stats, 0, ctx->stats);
+}
+
+void compress_ctx_destroy(compress_ctx *ctx) {
+  if (ctx == NULL)
+    return;
+#if defined(HAVE_THREADS)
+  if (ctx->thread_num > 1)
+    pool_quit(&ctx->pool);
 #endif
+  if (ctx->outbuf_mapped)
+    munmap(ctx->outbuf, ctx->outbuf_size);
+  else
+    cache_free(ctx->outbuf, ctx->outbuf_size);
+  cache_free(ctx->level_buf, ctx->level_size);
+  igzip_free(ctx);
+}
 
-  inbuf = (unsigned char *)malloc_safe(inbuf_size);
-  outbuf = (unsigned char *)malloc_safe(outbuf_size);
-  level_size = level_size_buf[compress_level];
-  level_buf = (unsigned char *)malloc_safe(level_size);
+/*
+ * Set up a deflate stream with the context's level and buffers, and put the
+ * gzip header in outbuf. stream->total_out is the header length.
+ */
+static void deflate_stream_begin(compress_ctx *ctx,
+                                 struct isal_zstream *stream) {
+  struct isal_gzip_header gz_hdr;
 
   isal_gzip_header_init(&gz_hdr);
   // do not save file name and timestamp in compress
   gz_hdr.os = UNIX;
 
-  isal_deflate_init(&stream);
-  stream.avail_in = 0;
-  stream.flush = NO_FLUSH;
-  stream.level = level;
-  stream.level_buf = level_buf;
-  stream.level_buf_size = level_size;
-  stream.gzip_flag = IGZIP_GZIP_NO_HDR;
-  stream.next_out = outbuf;
-  stream.avail_out = outbuf_size;
+  isal_deflate_init(stream);
+  stream->avail_in = 0;
+  stream->flush = NO_FLUSH;
+  stream->level = ctx->level;
+  stream->level_buf = ctx->level_buf;
+  stream->level_buf_size = ctx->level_size;
+  stream->gzip_flag = IGZIP_GZIP_NO_HDR;
+  stream->next_out = ctx->outbuf;
+  stream->avail_out = ctx->outbuf_size;
+
+  isal_write_gzip_header(stream, &gz_hdr);
+}
+
+// Compress input_string into sink as one gzip (or BGZF) stream
+static int compress_run(compress_ctx *ctx, unsigned char *input_string,
+                        size_t input_length, struct compress_sink *sink) {
+  unsigned char *outbuf = ctx->outbuf, *level_buf = ctx->level_buf;
+  size_t inbuf_size, outbuf_size = ctx->outbuf_size;
+  int level_size = ctx->level_size;
+  struct isal_zstream stream;
+  int ret, success = 0;
+  int bgzf = ctx->flags & COMPRESS_BGZF;
+  gzip_index *index = ctx->index;
+  igzip_stats *stats = sink->stats;
+  uint64_t start;
+  string_with_head input;
+  input.data = input_string;
+  input.offset = 0;
+  string_with_head *input_ptr = &input;
+
+  int level = ctx->level;
 
-  isal_write_gzip_header(&stream, &gz_hdr);
+  inbuf_size = ctx->block_size;
 
-  if (thread_num > 1) {
+  deflate_stream_begin(ctx, &stream);
+
+  // The stream starts on a member, this also clears a reused index
+  if (index != NULL)
+    gzip_index_add_point(index, 0, 0, NULL, 0, 1);
+
+  if (ctx->thread_num > 1) {
 #if defined(HAVE_THREADS)
-    int q;
+    struct thread_pool *pool = &ctx->pool;
     int end_of_stream = 0;
-    uint32_t crc = 0;
-    uint64_t total_in = 0;
 
-    // Write the header
-    fwrite_safe(outbuf, 1, stream.total_out, out, outfile_name);
+    // Write the header, BGZF blocks bring their own
+    if (!bgzf)
+      sink_write(sink, outbuf, stream.total_out);
 
+    pool_begin(pool, sink, ctx->flags, bgzf ? 0 : stream.total_out, index);
+
+    while (!end_of_stream && !atomic_load(&pool->failed)) {
+      size_t nread, dict_len = 0;
+      uint8_t *iptr = NULL;
+
+      pool_reserve_slot(pool, level_buf);
+      uint64_t slot = atomic_load(&pool->head) & (pool->queue_size - 1);
+
+      // jobs read straight from the caller's buffer, the producer never
+      // touches the payload and workers checksum it
+      nread = ustrnext(&iptr, input_ptr, ctx->block_size, input_length);
+      end_of_stream = ustr_eof(input_ptr, input_length);
+      stream.next_in = iptr;
+      stream.next_out = outbuf + ctx->block_size + slot * ctx->job_out_size;
+      stream.avail_in = nread;
+      stream.avail_out = ctx->job_out_size;
+      stream.end_of_stream = end_of_stream;
+      if (ctx->flags & COMPRESS_DICT_CHAIN) {
+        // prime with the tail of the previous block, as pigz does
+        dict_len = iptr - input_string;
+        if (dict_len > IGZIP_HIST_SIZE)
+          dict_len = IGZIP_HIST_SIZE;
+      }
+      pool_put_work(pool, &stream, iptr - dict_len, dict_len);
+    }
+
+    pool_drain(pool, level_buf);
+    pool_collect(pool, stats);
+    if (atomic_load(&pool->failed))
+      goto compress_run_cleanup;
+    pool_end(pool);
+#endif
+  } else if (bgzf) {
+    // As many whole blocks per round as outbuf can hold
+    size_t chunk = (outbuf_size / BGZF_MAX_BLOCK) * BGZF_BLOCK_SIZE;
+    uint64_t total_out = 0;
     do {
-      size_t nread;
-      size_t inbuf_used = 0;
-      size_t outbuf_used = 0;
-      uint8_t *iptr = inbuf;
-      uint8_t *optr = outbuf;
-
-      for (q = 0; q < MAX_JOBQUEUE - 1; q++) {
-        inbuf_used += BLOCK_SIZE;
-        outbuf_used += 2 * BLOCK_SIZE;
-        if (inbuf_used > inbuf_size || outbuf_used > outbuf_size)
-          break;
-
-        nread = ustrncpy(iptr, input_ptr, BLOCK_SIZE, input_length);
-        crc = crc32_gzip_refl(crc, iptr, nread);
-        end_of_stream = ustr_eof(input_ptr, input_length);
-        total_in += nread;
-        stream.next_in = iptr;
-        stream.next_out = optr;
-        stream.avail_in = nread;
-        stream.avail_out = 2 * BLOCK_SIZE;
-        stream.end_of_stream = end_of_stream;
-        ret = pool_put_work(&stream);
-        if (ret || end_of_stream)
-          break;
-
-        iptr += BLOCK_SIZE;
-        optr += 2 * BLOCK_SIZE;
+      uint8_t *iptr = NULL;
+      if (index != NULL)
+        gzip_index_add_point(index, total_out, input.offset, NULL, 0, 1);
+      size_t nread = ustrnext(&iptr, input_ptr, chunk, input_length);
+      start = igzip_clock_ns();
+      TRACE_BEGIN(TRACE_DEFLATE, nread);
+      size_t written =
+          bgzf_compress(iptr, nread, outbuf, outbuf_size, level, level_buf,
+                        level_size, ctx->flags & COMPRESS_ADAPTIVE);
+      TRACE_END(TRACE_DEFLATE);
+      stats->deflate_ns += igzip_clock_ns() - start;
+      if (nread > 0 && written == 0) {
+        log_print(ERROR, "igzip: Error encountered while compressing to %s\n",
+                  sink->name);
+        goto compress_run_cleanup;
       }
+      if (sink_write(sink, outbuf, written))
+        goto compress_run_cleanup;
+      total_out += written;
+    } while (!ustr_eof(input_ptr, input_length));
 
-      while (pool.tail != pool.head) { // Unprocessed jobs
-        int t = (pool.tail + 1) % MAX_JOBQUEUE;
-        if (pool.job[t].status >= JOB_SUCCESS) { // Finished next
-          if (pool.job[t].status > JOB_SUCCESS) {
-            success = 0;
-            log_print(ERROR,
-                      "igzip: Error encountered while compressing to file %s\n",
-                      outfile_name);
-            goto compress_file_cleanup;
-          }
-          fwrite_safe(pool.job[t].next_out, 1, pool.job[t].total_out, out,
-                      outfile_name);
+    sink_write(sink, bgzf_eof_block, sizeof(bgzf_eof_block));
+  } else if (ctx->flags & COMPRESS_ADAPTIVE) {
+    // Block by block as the pool does it, each with its own level. Half of
+    // outbuf per block leaves room for storing it
+    size_t chunk = outbuf_size / 2;
+    uint64_t total_out = stream.total_out;
+    uint32_t crc = 0;
+    int end_of_stream;
 
-          pool.job[t].total_out = 0;
-          pool.job[t].status = 0;
-          pool.tail = t;
-          pthread_cond_broadcast(&pool.cond);
-        }
-        // Pick up a job while we wait
-        pthread_mutex_lock(&pool.mutex);
-        if (!pool_has_work()) {
-          pthread_mutex_unlock(&pool.mutex);
-          continue;
-        }
+    sink_write(sink, outbuf, stream.total_out);
+    do {
+      uint8_t *iptr = NULL;
+      uint32_t written;
+      size_t nread = ustrnext(&iptr, input_ptr, chunk, input_length);
+      size_t dict_len = iptr - input_string;
+      if (dict_len > IGZIP_HIST_SIZE)
+        dict_len = IGZIP_HIST_SIZE;
+      end_of_stream = ustr_eof(input_ptr, input_length);
 
-        int work_idx = pool_get_work();
-        pthread_cond_signal(&pool.cond);
-        pthread_mutex_unlock(&pool.mutex);
-
-        isal_deflate_stateless_init(&stream);
-        stream.next_in = pool.job[work_idx].next_in;
-        stream.next_out = pool.job[work_idx].next_out;
-        stream.avail_in = pool.job[work_idx].avail_in;
-        stream.avail_out = pool.job[work_idx].avail_out;
-        stream.end_of_stream = pool.job[work_idx].type;
-        stream.flush = FULL_FLUSH;
-        stream.level = compress_level;
-        stream.level_buf = level_buf;
-        stream.level_buf_size = level_size;
-        int check = isal_deflate_stateless(&stream);
-        log_print(VERBOSE, "Self   finished job %d, out=%d\n", work_idx,
-                  stream.total_out);
-        pool.job[work_idx].total_out = stream.total_out;
-        pool.job[work_idx].status = JOB_SUCCESS + check; // complete or fail
+      if (index != NULL)
+        gzip_index_add_point(index, total_out, iptr - input_string,
+                             iptr - dict_len, dict_len, 0);
+      start = igzip_clock_ns();
+      TRACE_BEGIN(TRACE_DEFLATE, nread);
+      ret = deflate_block(iptr, nread, outbuf, outbuf_size, iptr - dict_len,
+                          dict_len, end_of_stream, level, level_buf,
+                          level_size, 1, &written);
+      TRACE_END(TRACE_DEFLATE);
+      if (ret) {
+        log_print(ERROR, "igzip: Error encountered while compressing to %s\n",
+                  sink->name);
+        goto compress_run_cleanup;
       }
+      stats->deflate_ns += igzip_clock_ns() - start;
+      start = igzip_clock_ns();
+      TRACE_BEGIN(TRACE_CRC, nread);
+      crc = crc32_gzip_refl(crc, iptr, nread);
+      TRACE_END(TRACE_CRC);
+      stats->crc_ns += igzip_clock_ns() - start;
+      if (sink_write(sink, outbuf, written))
+        goto compress_run_cleanup;
+      total_out += written;
     } while (!end_of_stream);
 
-    // Write gzip trailer
-    fwrite_safe(&crc, sizeof(uint32_t), 1, out, outfile_name);
-    fwrite_safe(&total_in, sizeof(uint32_t), 1, out, outfile_name);
-
-#else // No compiled threading support but asked for threads > 1
-    log_print(
-        ERROR,
-        "igzip: No compiled threading support but asked for threads > 1\n");
-    // assert(false);
-#endif
+    uint32_t isize = input_length;
+    sink_write(sink, &crc, sizeof(uint32_t));
+    sink_write(sink, &isize, sizeof(uint32_t));
   } else { // Single thread
+    // isal_zstream.total_out is 32 bits, checkpoints need the full offset
+    uint64_t total_out = 0;
     do {
       if (stream.avail_in == 0) {
-        stream.next_in = inbuf;
+        size_t want = inbuf_size;
+        if (index != NULL &&
+            gzip_index_next_point(index) - input.offset <= want) {
+          // End the chunk on the checkpoint and flush to a byte boundary
+          want = gzip_index_next_point(index) - input.offset;
+          stream.flush = SYNC_FLUSH;
+        }
         stream.avail_in =
-            ustrncpy(stream.next_in, input_ptr, inbuf_size, input_length);
+            ustrnext(&stream.next_in, input_ptr, want, input_length);
         stream.end_of_stream = ustr_eof(input_ptr, input_length);
       }
 
@@ -393,34 +1524,616 @@ int compress_file(unsigned char *input_string, size_t input_length,
         stream.avail_out = outbuf_size;
       }
 
+      start = igzip_clock_ns();
+      TRACE_BEGIN(TRACE_DEFLATE, stream.avail_in);
       ret = isal_deflate(&stream);
+      TRACE_END(TRACE_DEFLATE);
+      stats->deflate_ns += igzip_clock_ns() - start;
 
       if (ret != ISAL_DECOMP_OK) {
-        log_print(ERROR,
-                  "igzip: Error encountered while compressing to file %s\n",
-                  outfile_name);
-        goto compress_file_cleanup;
+        log_print(ERROR, "igzip: Error encountered while compressing to %s\n",
+                  sink->name);
+        goto compress_run_cleanup;
       }
 
-      fwrite_safe(outbuf, 1, stream.next_out - outbuf, out, outfile_name);
+      if (sink_write(sink, outbuf, stream.next_out - outbuf))
+        goto compress_run_cleanup;
+      total_out += stream.next_out - outbuf;
       stream.next_out = NULL;
 
+      if (stream.flush == SYNC_FLUSH && stream.avail_in == 0 &&
+          stream.avail_out != 0) {
+        if (!stream.end_of_stream) {
+          size_t window_len =
+              input.offset < IGZIP_HIST_SIZE ? input.offset : IGZIP_HIST_SIZE;
+          gzip_index_add_point(index, total_out, input.offset,
+                               input.data + input.offset - window_len,
+                               window_len, 0);
+        }
+        stream.flush = NO_FLUSH;
+      }
+
     } while (!ustr_eof(input_ptr, input_length) || stream.avail_out == 0);
   }
 
-  success = 1;
+  success = !sink->overflow;
+
+compress_run_cleanup:
+
+  return (success == 0);
+}
+
+int compress_file_ctx(compress_ctx *ctx, unsigned char *input_string,
+                      size_t input_length, const char *outfile_name) {
+  FILE *out = NULL;
+  struct compress_sink sink = {0};
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns();
+  int ret;
+
+  if (input_string == NULL)
+    return 1;
+
+  open_out_file(&out, outfile_name);
+  if (out == NULL)
+    return 1;
+
+  // Nothing goes through stdio from here on
+  fflush(out);
+  sink_open_fd(&sink, fileno(out), outfile_name != NULL ? outfile_name : "stdout",
+               ctx->thread_num, ctx->flags & COMPRESS_DIRECT_IO, ctx->io_size,
+               ctx->io_depth);
+  sink.stats = &stats;
+  ret = compress_run(ctx, input_string, input_length, &sink);
+  sink_close(&sink);
+
+  if (out != stdout)
+    fclose(out);
+  stats.bytes_in = input_length;
+  stats.bytes_out = sink.length;
+  compress_stats_end(ctx, &stats, begin);
+  return ret;
+}
+
+int compress_fd_ctx(compress_ctx *ctx, unsigned char *input_string,
+                    size_t input_length, int fd) {
+  struct compress_sink sink = {0};
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns();
+  int ret;
+
+  if (input_string == NULL || fd < 0)
+    return 1;
+
+  sink_open_fd(&sink, fd, "file descriptor", ctx->thread_num,
+               ctx->flags & COMPRESS_DIRECT_IO, ctx->io_size, ctx->io_depth);
+  sink.stats = &stats;
+  ret = compress_run(ctx, input_string, input_length, &sink);
+  sink_close(&sink);
+  stats.bytes_in = input_length;
+  stats.bytes_out = sink.length;
+  compress_stats_end(ctx, &stats, begin);
+  return ret;
+}
+
+int compress_file_opts(unsigned char *input_string, size_t input_length,
+                       const char *outfile_name, const igzip_options *options) {
+  compress_ctx *ctx;
+  igzip_options opts = *options;
+  int ret;
+
+  if (input_string == NULL)
+    return 1;
+
+  igzip_options_tune(&opts, input_length);
+  ctx = compress_ctx_create_opts(&opts);
+  if (ctx == NULL)
+    return 1;
+  ret = compress_file_ctx(ctx, input_string, input_length, outfile_name);
+  compress_ctx_destroy(ctx);
+  return ret;
+}
+
+int compress_buffer_ctx(compress_ctx *ctx, unsigned char *input_string,
+                        size_t input_length, unsigned char *output_string,
+                        size_t output_capacity, size_t *output_length) {
+  struct compress_sink sink = {0};
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns();
+  int ret;
+
+  *output_length = 0;
+  if (input_string == NULL || output_string == NULL)
+    return 1;
+
+  sink.name = "memory buffer";
+  sink.buf = output_string;
+  sink.capacity = output_capacity;
+  sink.stats = &stats;
+  ret = compress_run(ctx, input_string, input_length, &sink);
+
+  stats.bytes_in = input_length;
+  stats.bytes_out = sink.length;
+  compress_stats_end(ctx, &stats, begin);
+  *output_length = sink.length;
+  if (sink.overflow) {
+    log_print(ERROR, "igzip: Output buffer too small for compressed data\n");
+    return BUFFER_TOO_SMALL;
+  }
+  return ret;
+}
+
+int compress_batch_ctx(compress_ctx *ctx, compress_record *records,
+                       size_t count) {
+  int raw = ctx->flags & COMPRESS_RAW;
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns();
+  size_t i;
 
+  if (records == NULL && count > 0)
+    return 1;
+  // Each record is one plain member, block level framing doesn't apply
+  if (ctx->flags & (COMPRESS_BGZF | COMPRESS_ADAPTIVE)) {
+    log_print(ERROR, "igzip: BGZF and adaptive modes don't apply to batches\n");
+    return 1;
+  }
+
+  if (ctx->thread_num > 1 && count > 1) {
 #if defined(HAVE_THREADS)
-  if (thread_num > 1)
-    pool_quit(thread_num);
+    struct thread_pool *pool = &ctx->pool;
+    size_t first = 0, slice_input = 0;
+
+    // Records go out in slices of about BATCH_JOB_SIZE input, so small ones
+    // don't pay a queue round trip each; the writer only retires the slots
+    pool_begin(pool, NULL, ctx->flags, 0, NULL);
+    for (i = 0; i < count; i++) {
+      slice_input += records[i].input_length;
+      if (slice_input >= BATCH_JOB_SIZE || i + 1 == count) {
+        pool_reserve_slot(pool, ctx->level_buf);
+        pool_put_records(pool, records + first, i + 1 - first);
+        first = i + 1;
+        slice_input = 0;
+      }
+    }
+    pool_drain(pool, ctx->level_buf);
+    pool_collect(pool, &stats);
 #endif
+  } else {
+    for (i = 0; i < count; i++)
+      compress_record_run(&records[i], ctx->level, ctx->level_buf,
+                          ctx->level_size, raw);
+    stats.deflate_ns = igzip_clock_ns() - begin;
+  }
 
-compress_file_cleanup:
+  for (i = 0; i < count; i++) {
+    stats.bytes_in += records[i].input_length;
+    stats.bytes_out += records[i].output_length;
+  }
+  compress_stats_end(ctx, &stats, begin);
+  for (i = 0; i < count; i++)
+    if (records[i].status != 0)
+      return 1;
+  return 0;
+}
 
-  if (out != NULL && out != stdout)
-    fclose(out);
+size_t compress_bound(size_t input_length) {
+  // Literal only Huffman codes stay within 9 bits a byte; on top come block
+  // headers, flush markers and, for BGZF, the framing of every block
+  size_t blocks = input_length / BGZF_BLOCK_SIZE + 1;
+  return input_length + (input_length >> 3) + blocks * 64 +
+         sizeof(bgzf_eof_block) + 64;
+}
 
-  return (success == 0);
+/*
+ * compress_file keeps the context of its last call per thread, so that a
+ * thread calling it repeatedly with one level and thread count reuses the
+ * pool and buffers rather than setting them up every time. It lives until
+ * the thread exits or calls compress_cache_release.
+ */
+#if defined(HAVE_THREADS)
+static pthread_key_t ctx_cache_key;
+static pthread_once_t ctx_cache_once = PTHREAD_ONCE_INIT;
+
+static void ctx_cache_release(void *ctx) {
+  compress_ctx_destroy((compress_ctx *)ctx);
+}
+
+static void ctx_cache_key_create(void) {
+  pthread_key_create(&ctx_cache_key, ctx_cache_release);
+}
+
+static compress_ctx *ctx_cache_swap(compress_ctx *ctx) {
+  compress_ctx *cached;
+  pthread_once(&ctx_cache_once, ctx_cache_key_create);
+  cached = (compress_ctx *)pthread_getspecific(ctx_cache_key);
+  pthread_setspecific(ctx_cache_key, ctx);
+  return cached;
+}
+#else
+static compress_ctx *ctx_cache_swap(compress_ctx *ctx) {
+  static _Thread_local compress_ctx *cached;
+  compress_ctx *prev = cached;
+  cached = ctx;
+  return prev;
+}
+#endif
+
+// The cached context if it fits, else a new one; NULL on failure
+static compress_ctx *ctx_cache_take(int compress_level, int thread_num) {
+  // Taken out while in use, a nested call gets a context of its own
+  compress_ctx *ctx = ctx_cache_swap(NULL);
+#if !defined(HAVE_THREADS)
+  thread_num = 1;
+#endif
+  if (thread_num < 1)
+    thread_num = 1;
+
+  if (ctx != NULL &&
+      (ctx->level != compress_level || ctx->thread_num != thread_num)) {
+    compress_ctx_destroy(ctx);
+    ctx = NULL;
+  }
+  if (ctx == NULL)
+    ctx = compress_ctx_create(compress_level, thread_num);
+  return ctx;
+}
+
+// Keep ctx for the next call, whatever a nested call cached meanwhile goes
+static void ctx_cache_put(compress_ctx *ctx) {
+  ctx = ctx_cache_swap(ctx);
+  if (ctx != NULL)
+    compress_ctx_destroy(ctx);
+}
+
+void compress_cache_release(void) {
+  compress_ctx *ctx = ctx_cache_swap(NULL);
+  if (ctx != NULL)
+    compress_ctx_destroy(ctx);
+}
+
+int compress_file(unsigned char *input_string, size_t input_length,
+                  const char *outfile_name, int compress_level,
+                  int thread_num) {
+  int ret;
+  compress_ctx *ctx = ctx_cache_take(compress_level, thread_num);
+  if (ctx == NULL)
+    return 1;
+
+  ret = compress_file_ctx(ctx, input_string, input_length, outfile_name);
+  ctx_cache_put(ctx);
+  return ret;
+}
+
+// defined with the streaming compressor below
+static igzip_stats *compress_stream_stats(compress_stream *cs);
+
+int compress_file_from_file(compress_ctx *ctx, const char *infile_name,
+                            const char *outfile_name) {
+  FILE *in = NULL;
+  unsigned char *map;
+  size_t length = 0;
+  int ret = 1;
+
+  if (ctx == NULL)
+    return 1;
+
+  open_in_file(&in, infile_name);
+  if (in == NULL)
+    return 1;
+
+  // Regular files are compressed in place from a mapping
+  map = mmap_in_file(in, infile_name, &length);
+  if (map != NULL) {
+    ret = compress_file_ctx(ctx, map, length, outfile_name);
+    release_in_file(map, length, true);
+  } else {
+    // Pipes and stdin go through the streaming compressor as they are read
+    compress_stream *stream = compress_stream_open(ctx, outfile_name);
+    if (stream != NULL) {
+      // read ahead on a helper thread while the current buffer compresses
+      async_io *reader =
+          async_reader_open(in, infile_name, ctx->io_size, ctx->io_depth);
+      igzip_stats read_stats = {0};
+      unsigned char *buf;
+      size_t nread;
+      ret = 0;
+      while (ret == 0 && (buf = async_read(reader, &nread)) != NULL &&
+             nread > 0)
+        ret = compress_stream_write(stream, buf, nread);
+      // bytes_in is already counted by the writes
+      async_io_set_stats(reader, &read_stats);
+      async_io_close(reader);
+      compress_stream_stats(stream)->read_ns += read_stats.read_ns;
+      compress_stream_stats(stream)->read_calls += read_stats.read_calls;
+      ret |= compress_stream_finish(stream);
+    }
+  }
+
+  if (in != stdin)
+    fclose(in);
+  return ret;
+}
+
+int compress_buffer(unsigned char *input_string, size_t input_length,
+                    unsigned char *output_string, size_t output_capacity,
+                    size_t *output_length, int compress_level,
+                    int thread_num) {
+  int ret;
+  // Shares compress_file's cached context rather than a pool per payload
+  compress_ctx *ctx = ctx_cache_take(compress_level, thread_num);
+  if (ctx == NULL) {
+    *output_length = 0;
+    return 1;
+  }
+
+  ret = compress_buffer_ctx(ctx, input_string, input_length, output_string,
+                            output_capacity, output_length);
+  ctx_cache_put(ctx);
+  return ret;
+}
+
+/*
+ * Push style compressor over a context. The single thread stream deflates
+ * each chunk in place as it is written. Parallel and BGZF modes stage input
+ * into blocks; in parallel mode each queue slot has its own staging area so
+ * a block stays put until its job has retired, with room in front for the
+ * history a DICT_CHAIN block is primed with.
+ */
+static inline size_t stream_area_size(const compress_ctx *ctx) {
+  return IGZIP_HIST_SIZE + ctx->block_size;
+}
+struct _compress_stream {
+  compress_ctx *ctx;
+  FILE *out;
+  struct compress_sink sink;
+  struct isal_zstream stream; // single thread deflate state
+  unsigned char *inbuf;       // staging areas, NULL for single thread deflate
+  size_t inbuf_size;
+  size_t block_size;          // input per staged block
+  unsigned char *fill;        // staged input of the open block
+  size_t fill_len;
+  size_t dict_len; // history copied in front of fill
+  int failed;
+  igzip_stats stats;
+  uint64_t begin;
+};
+
+static igzip_stats *compress_stream_stats(compress_stream *cs) {
+  return &cs->stats;
+}
+
+// Deflate until the pending input is taken and no output is held back
+static int stream_deflate(compress_stream *cs) {
+  struct isal_zstream *stream = &cs->stream;
+  unsigned char *outbuf = cs->ctx->outbuf;
+  int ret;
+
+  do {
+    uint64_t start = igzip_clock_ns();
+    stream->next_out = outbuf;
+    stream->avail_out = cs->ctx->outbuf_size;
+    TRACE_BEGIN(TRACE_DEFLATE, stream->avail_in);
+    ret = isal_deflate(stream);
+    TRACE_END(TRACE_DEFLATE);
+    cs->stats.deflate_ns += igzip_clock_ns() - start;
+    if (ret != COMP_OK) {
+      log_print(ERROR, "igzip: Error encountered while compressing to %s\n",
+                cs->sink.name);
+      return 1;
+    }
+    if (sink_write(&cs->sink, outbuf, stream->next_out - outbuf))
+      return 1;
+  } while (stream->avail_in > 0 || stream->avail_out == 0);
+  return 0;
+}
+
+static int stream_bgzf_block(compress_stream *cs) {
+  compress_ctx *ctx = cs->ctx;
+  uint64_t start = igzip_clock_ns();
+  TRACE_BEGIN(TRACE_DEFLATE, cs->fill_len);
+  size_t written =
+      bgzf_compress(cs->fill, cs->fill_len, ctx->outbuf, ctx->outbuf_size,
+                    ctx->level, ctx->level_buf, ctx->level_size,
+                    ctx->flags & COMPRESS_ADAPTIVE);
+  TRACE_END(TRACE_DEFLATE);
+  cs->stats.deflate_ns += igzip_clock_ns() - start;
+  if (cs->fill_len > 0 && written == 0) {
+    log_print(ERROR, "igzip: Error encountered while compressing to %s\n",
+              cs->sink.name);
+    return 1;
+  }
+  cs->fill_len = 0;
+  return sink_write(&cs->sink, ctx->outbuf, written);
+}
+
+#if defined(HAVE_THREADS)
+// Claim the next queue slot and start a block in its staging area
+static void stream_open_block(compress_stream *cs) {
+  struct thread_pool *pool = &cs->ctx->pool;
+  unsigned char *prev_end = cs->fill + cs->fill_len;
+  size_t prev_len = cs->fill != NULL ? cs->dict_len + cs->fill_len : 0;
+
+  pool_reserve_slot(pool, cs->ctx->level_buf);
+  uint64_t slot = atomic_load(&pool->head) & (pool->queue_size - 1);
+  cs->fill = cs->inbuf + slot * stream_area_size(cs->ctx) + IGZIP_HIST_SIZE;
+  cs->fill_len = 0;
+  cs->dict_len = 0;
+  if (cs->ctx->flags & COMPRESS_DICT_CHAIN) {
+    // only the producer writes staging areas, so the previous one is intact
+    cs->dict_len = prev_len < IGZIP_HIST_SIZE ? prev_len : IGZIP_HIST_SIZE;
+    memmove(cs->fill - cs->dict_len, prev_end - cs->dict_len, cs->dict_len);
+  }
+}
+
+// Publish the open block into the slot taken by stream_open_block
+static void stream_submit_block(compress_stream *cs, int end_of_stream) {
+  struct thread_pool *pool = &cs->ctx->pool;
+  uint64_t slot = atomic_load(&pool->head) & (pool->queue_size - 1);
+  struct isal_zstream job;
+
+  job.next_in = cs->fill;
+  job.avail_in = cs->fill_len;
+  job.next_out =
+      cs->ctx->outbuf + cs->ctx->block_size + slot * cs->ctx->job_out_size;
+  job.avail_out = cs->ctx->job_out_size;
+  job.end_of_stream = end_of_stream;
+  pool_put_work(pool, &job, cs->fill - cs->dict_len, cs->dict_len);
+}
+#endif
+
+compress_stream *compress_stream_open(compress_ctx *ctx,
+                                      const char *outfile_name) {
+  compress_stream *cs;
+  FILE *out = NULL;
+
+  if (ctx == NULL)
+    return NULL;
+
+  open_out_file(&out, outfile_name);
+  if (out == NULL)
+    return NULL;
+
+  cs = (compress_stream *)malloc_safe(sizeof(compress_stream));
+  memset(cs, 0, sizeof(compress_stream));
+  cs->begin = igzip_clock_ns();
+  cs->ctx = ctx;
+  cs->out = out;
+  fflush(out);
+  sink_open_fd(&cs->sink, fileno(out),
+               outfile_name != NULL ? outfile_name : "stdout", ctx->thread_num,
+               ctx->flags & COMPRESS_DIRECT_IO, ctx->io_size, ctx->io_depth);
+  cs->sink.stats = &cs->stats;
+
+  deflate_stream_begin(ctx, &cs->stream);
+  // Write the header, BGZF blocks bring their own
+  if (!(ctx->flags & COMPRESS_BGZF))
+    sink_write(&cs->sink, ctx->outbuf, cs->stream.total_out);
+
+  if (ctx->thread_num > 1) {
+#if defined(HAVE_THREADS)
+    cs->block_size = ctx->block_size;
+    cs->inbuf_size = ctx->pool.queue_size * stream_area_size(ctx);
+    cs->inbuf = (unsigned char *)cache_alloc(cs->inbuf_size);
+    pool_begin(&ctx->pool, &cs->sink, ctx->flags,
+               (ctx->flags & COMPRESS_BGZF) ? 0 : cs->stream.total_out, NULL);
+    stream_open_block(cs);
+#endif
+  } else if (ctx->flags & COMPRESS_BGZF) {
+    // As many whole blocks per round as outbuf can hold
+    cs->block_size = (ctx->outbuf_size / BGZF_MAX_BLOCK) * BGZF_BLOCK_SIZE;
+    cs->inbuf_size = cs->block_size;
+    cs->inbuf = (unsigned char *)cache_alloc(cs->inbuf_size);
+    cs->fill = cs->inbuf;
+  }
+  return cs;
+}
+
+int compress_stream_write(compress_stream *cs, unsigned char *data,
+                          size_t length) {
+  if (cs == NULL)
+    return 1;
+
+  cs->stats.bytes_in += length;
+  while (length > 0 && !cs->failed) {
+    size_t n;
+    if (cs->inbuf == NULL) {
+      n = length < cs->ctx->block_size ? length : cs->ctx->block_size;
+      cs->stream.next_in = data;
+      cs->stream.avail_in = n;
+      cs->failed = stream_deflate(cs);
+    } else {
+      n = cs->block_size - cs->fill_len;
+      if (n > length)
+        n = length;
+      uint64_t start = igzip_clock_ns();
+      memcpy(cs->fill + cs->fill_len, data, n);
+      cs->stats.copy_ns += igzip_clock_ns() - start;
+      cs->fill_len += n;
+      if (cs->fill_len == cs->block_size) {
+        if (cs->ctx->thread_num > 1) {
+#if defined(HAVE_THREADS)
+          stream_submit_block(cs, 0);
+          stream_open_block(cs);
+          cs->failed = atomic_load(&cs->ctx->pool.failed);
+#endif
+        } else {
+          cs->failed = stream_bgzf_block(cs);
+        }
+      }
+    }
+    data += n;
+    length -= n;
+  }
+  return cs->failed;
+}
+
+int compress_stream_flush(compress_stream *cs) {
+  if (cs == NULL || cs->failed)
+    return 1;
+
+  if (cs->ctx->thread_num > 1) {
+#if defined(HAVE_THREADS)
+    struct thread_pool *pool = &cs->ctx->pool;
+    // Blocks end byte aligned already, so only the open one must go out
+    if (cs->fill_len > 0)
+      stream_submit_block(cs, 0);
+    else
+      sem_post(&pool->free_slots); // hand back the unused slot
+    pool_drain(pool, cs->ctx->level_buf);
+    cs->failed = atomic_load(&pool->failed);
+    stream_open_block(cs);
+#endif
+  } else if (cs->inbuf != NULL) {
+    cs->failed = stream_bgzf_block(cs);
+  } else {
+    cs->stream.flush = SYNC_FLUSH;
+    cs->failed = stream_deflate(cs);
+    cs->stream.flush = NO_FLUSH;
+  }
+
+  if (!cs->failed)
+    sink_flush(&cs->sink);
+  return cs->failed;
+}
+
+int compress_stream_finish(compress_stream *cs) {
+  int ret;
+  if (cs == NULL)
+    return 1;
+
+  if (cs->ctx->thread_num > 1) {
+#if defined(HAVE_THREADS)
+    struct thread_pool *pool = &cs->ctx->pool;
+    if (!cs->failed)
+      stream_submit_block(cs, 1);
+    else
+      sem_post(&pool->free_slots);
+    // Drain even after a failure, the context stays usable
+    pool_drain(pool, cs->ctx->level_buf);
+    pool_collect(pool, &cs->stats);
+    cs->failed = atomic_load(&pool->failed);
+    if (!cs->failed)
+      pool_end(pool);
+#endif
+  } else if (cs->inbuf != NULL) {
+    if (!cs->failed)
+      cs->failed = stream_bgzf_block(cs);
+    if (!cs->failed)
+      sink_write(&cs->sink, bgzf_eof_block, sizeof(bgzf_eof_block));
+  } else if (!cs->failed) {
+    cs->stream.end_of_stream = 1;
+    cs->failed = stream_deflate(cs);
+  }
+
+  ret = cs->failed;
+  sink_close(&cs->sink);
+  if (cs->out != stdout)
+    fclose(cs->out);
+  cs->stats.bytes_out = cs->sink.length;
+  compress_stats_end(cs->ctx, &cs->stats, cs->begin);
+  cache_free(cs->inbuf, cs->inbuf_size);
+  igzip_free(cs);
+  return ret;
 }
 
 #ifdef __cplusplus
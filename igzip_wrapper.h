@@ -7,10 +7,12 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <utime.h>
 
@@ -18,7 +20,13 @@
 extern "C" {
 #endif
 
-#define BLOCK_SIZE (1024 * 1024)
+#define BLOCK_SIZE (1024 * 1024) // default input per parallel job
+#define MIN_BLOCK_SIZE (64 * 1024)
+#define MAX_BLOCK_SIZE (8 * 1024 * 1024)
+#define ASYNC_IO_DEPTH 4 // buffers in flight between a file and (de)compression
+#define DIRECT_IO_ALIGN 4096 // buffer, length and offset alignment of O_DIRECT
+#define BUFFER_CACHE_SLOTS 8 // released buffers kept per thread for reuse
+#define BUFFER_CACHE_BYTES (64 * 1024 * 1024) // most bytes cached per thread
 
 // Config options
 #ifndef _IGZIP_IS_INTERACTIVE
@@ -31,11 +39,16 @@ extern "C" {
 #define _IGZIP_FILE_FORCE_OVERRITTEN 0 // not overritten by default
 #endif
 
+// the config options above, changed at run time
+void igzip_set_verbose_level(int level);
+void igzip_set_overwrite(int interactive, int force);
+
 // Error exit codes
 #define MALLOC_FAILED -1
 #define FILE_OPEN_ERROR -2
 #define FILE_READ_ERROR -3
 #define FILE_WRITE_ERROR -4
+#define BUFFER_TOO_SMALL -5
 
 enum log_types { INFORM, WARN, ERROR, VERBOSE };
 
@@ -52,16 +65,345 @@ void open_in_file(FILE **in, const char *infile_name);
 void open_out_file(FILE **out, const char *outfile_name);
 size_t fread_safe(void *buf, size_t word_size, size_t buf_size, FILE *in,
                   const char *file_name);
+// read the rest of a file or pipe into one malloc'd buffer
+unsigned char *fread_all(FILE *in, const char *file_name, size_t *length);
+// map a regular file read-only for one sequential pass, NULL for pipes
+unsigned char *mmap_in_file(FILE *in, const char *file_name, size_t *length);
+// keep MMAP_WINDOW read ahead of pos and drop the pages behind it, dropped
+// tracks how far they are already gone and starts at 0
+#define MMAP_WINDOW (8u << 20)
+void mmap_slide(unsigned char *map, size_t length, size_t *dropped,
+                size_t pos);
+// the rest of a file, mapped when possible and read with fread_all otherwise
+unsigned char *load_in_file(FILE *in, const char *file_name, size_t *length,
+                            bool *mapped);
+void release_in_file(unsigned char *data, size_t length, bool mapped);
 size_t fwrite_safe(void *buf, size_t word_size, size_t buf_size, FILE *out,
                    const char *file_name);
+void *malloc_aligned_safe(size_t alignment, size_t size);
+// old_size is only needed when a custom allocator has to copy
+void *realloc_safe(void *ptr, size_t old_size, size_t size);
+// DIRECT_IO_ALIGN aligned buffer, reused from the calling thread's cache
+void *cache_alloc(size_t size);
+// back into the calling thread's cache, size as passed to cache_alloc
+void cache_free(void *ptr, size_t size);
+// CPUs of a list like "0-3,8,10-11" into cpus, how many or -1 if malformed
+int parse_cpu_list(const char *list, int *cpus, int max_cpus);
+// NUMA node of every CPU below max_cpu as sysfs has it, 0 where unknown
+void cpu_nodes(int *node, int max_cpu);
+
+/*
+ * Allocator hook: every buffer the library allocates comes from alloc and
+ * goes back through release, e.g. to serve them from a pool or huge pages.
+ * Set it before any other call; NULL restores malloc.
+ */
+typedef struct _igzip_allocator {
+  void *(*alloc)(void *opaque, size_t size, size_t alignment);
+  void (*release)(void *opaque, void *ptr);
+  void *opaque;
+} igzip_allocator;
+void igzip_set_allocator(const igzip_allocator *allocator);
+// release memory the library handed out, e.g. by decompress_file_alloc
+void igzip_free(void *ptr);
+
+/*
+ * Where the time of a call went. Phase times are summed over every thread
+ * taking part, so on a parallel call they can add up to more than total_ns.
+ * worker_busy_ns[worker_count - 1] is the calling thread, which also runs
+ * jobs while the queue is full; threads past IGZIP_STATS_MAX_WORKERS share
+ * the last slot.
+ */
+#define IGZIP_STATS_MAX_WORKERS 64
+typedef struct _igzip_stats {
+  uint64_t calls;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t total_ns;   // wall time of the call
+  uint64_t read_ns;    // caller waiting for input from a file or pipe
+  uint64_t copy_ns;    // staging data into blocks and I/O buffers
+  uint64_t crc_ns;     // CRC-32 outside of the deflate pass
+  uint64_t deflate_ns; // deflate and stored blocks, BGZF CRCs included
+  uint64_t inflate_ns; // inflate, CRC checks included
+  uint64_t write_ns;   // write syscalls and copies into caller buffers
+  uint64_t stall_ns;   // producer waiting for a free job slot or buffer
+  uint64_t jobs;       // blocks, batch slices or members handed to threads
+  uint64_t read_calls;
+  uint64_t write_calls;
+  uint64_t worker_count;
+  uint64_t worker_busy_ns[IGZIP_STATS_MAX_WORKERS];
+} igzip_stats;
+// process wide sums of every call so far, either may be NULL; worker_count
+// is the most threads any call used
+void igzip_stats_get(igzip_stats *compress, igzip_stats *decompress);
+void igzip_stats_reset(void);
+// used by the library: a monotonic clock, busy time of thread number worker
+// and ending a call's accounting
+uint64_t igzip_clock_ns(void);
+void igzip_stats_busy(igzip_stats *stats, size_t worker, uint64_t ns);
+void igzip_stats_commit(igzip_stats *call, int decompress, igzip_stats *out);
+
+/*
+ * Event tracing, built in with -D_IGZIP_TRACE=1 (cmake -DIGZIP_TRACE=ON).
+ * Every thread records begin and end events into a ring of its own of
+ * IGZIP_TRACE_EVENTS, overwriting the oldest once it is full. Without it
+ * the TRACE_ macros are empty and the calls below do nothing.
+ */
+#ifndef _IGZIP_TRACE
+#define _IGZIP_TRACE 0 // not traced by default
+#endif
+#define IGZIP_TRACE_EVENTS (64 * 1024)
+enum trace_types {
+  TRACE_SUBMIT,  // producer publishing a job
+  TRACE_STALL,   // producer waiting for a free job slot
+  TRACE_DEFLATE, // deflate and stored blocks
+  TRACE_CRC,     // CRC-32 outside of the deflate pass
+  TRACE_WRITE,   // write syscalls
+  TRACE_WAIT,    // writer waiting for the next block in order
+  TRACE_READ,    // read syscalls
+  TRACE_REFILL,  // caller waiting for input
+  TRACE_INFLATE
+};
+// recording is on from the start; clear and dump while no call is running
+void igzip_trace_enable(int on);
+void igzip_trace_clear(void);
+// Chrome trace event JSON, for chrome://tracing or ui.perfetto.dev. Returns
+// the number of events written, -1 on a write error
+int igzip_trace_dump(FILE *out);
+#if _IGZIP_TRACE
+void trace_event(int type, int phase, uint64_t arg);
+void trace_thread_name(const char *name); // a string literal
+#define TRACE_BEGIN(type, arg) trace_event(type, 'B', arg)
+#define TRACE_END(type) trace_event(type, 'E', 0)
+#define TRACE_NAME(name) trace_thread_name(name)
+#else
+#define TRACE_BEGIN(type, arg) ((void)0)
+#define TRACE_END(type) ((void)0)
+#define TRACE_NAME(name) ((void)0)
+#endif
+
+/*
+ * Raw output descriptor, written with writev and no stdio copy. It copes
+ * with pipes and sockets taking partial writes, and with direct set writes
+ * aligned runs to a regular file with O_DIRECT.
+ */
+typedef struct _out_fd {
+  int fd;
+  const char *name;
+  int direct;    // O_DIRECT wanted and possible
+  int direct_on; // O_DIRECT currently set on fd
+  uint64_t offset;
+  uint64_t writes;   // writev calls made
+  uint64_t write_ns; // time spent in them
+} out_fd;
+void out_fd_init(out_fd *out, int fd, const char *name, int direct);
+// writes all of iov, which is used up in the process
+void out_fd_writev(out_fd *out, struct iovec *iov, int iovcnt);
+void out_fd_finish(out_fd *out);
+
+/*
+ * Double buffered I/O: a helper thread reads ahead into, or writes behind
+ * from, a ring of depth buffers while the caller works on the one it holds.
+ */
+typedef struct _async_io async_io;
+async_io *async_reader_open(FILE *in, const char *infile_name,
+                            size_t buf_size, int depth);
+// next buffer of input, recycling the one returned before; 0 at the end
+unsigned char *async_read(async_io *io, size_t *length);
+int async_eof(async_io *io);
+async_io *async_writer_open(out_fd *out, size_t buf_size, int depth);
+// an empty buf_size buffer (DIRECT_IO_ALIGN aligned) to fill, queued for writing with async_write
+unsigned char *async_write_buffer(async_io *io);
+void async_write(async_io *io, size_t length);
+// wait until every queued buffer has been written
+void async_flush(async_io *io);
+// on close, add to stats the time the caller waited and, for a reader, the
+// bytes and read calls
+void async_io_set_stats(async_io *io, igzip_stats *stats);
+void async_io_close(async_io *io);
+
+// CRC-32 of A|B from crc1 of A, crc2 of B and the length of B
+uint32_t crc32_gzip_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/*
+ * Tuning of a compress or decompress call. Zero fields are picked by
+ * igzip_options_tune, the rest are kept (block_size clamped to
+ * [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE]).
+ */
+typedef struct _igzip_options {
+  int level;             // compression level, 1 after igzip_options_init
+  int thread_num;        // 0: one per online core
+  int flags;             // COMPRESS_* output format flags
+  size_t block_size;     // input per parallel job
+  int queue_depth;       // jobs in flight, rounded up to a power of 2
+  size_t io_buffer_size; // async file I/O buffer, defaults to block_size
+  int io_depth;          // async file I/O buffers in flight
+  igzip_stats *stats;    // filled by the call when not NULL
+  const char *cpus;      // pin workers to these CPUs, e.g. "0-15,32-47"
+  int numa;              // keep each job on the NUMA node of its buffers
+} igzip_options;
+void igzip_options_init(igzip_options *opts);
+// fill in zero fields for input_length bytes, SIZE_MAX when not known:
+// small inputs get small blocks and fewer threads, large ones up to 8 MiB
+void igzip_options_tune(igzip_options *opts, size_t input_length);
 
 /* igzip inflate wrapper */
 int decompress_file(const char *infile_name, unsigned char *output_string,
                     size_t *output_length);
+// returns BUFFER_TOO_SMALL when the data exceeds output_capacity
+int decompress_file_bounded(const char *infile_name,
+                            unsigned char *output_string,
+                            size_t output_capacity, size_t *output_length);
+// inflates the members of a concatenated gzip file concurrently, on the
+// caller and a process wide pool that keeps its threads between calls
+int decompress_file_mt(const char *infile_name, unsigned char *output_string,
+                       size_t output_capacity, size_t *output_length,
+                       int thread_num);
+// memory to memory, concatenated members inflated as decompress_file_mt does
+int decompress_buffer(unsigned char *input_string, size_t input_length,
+                      unsigned char *output_string, size_t output_capacity,
+                      size_t *output_length, int thread_num);
+
+/*
+ * Uncompressed size read from the ISIZE trailer of every member, without
+ * inflating. size_flags tells when the sum can be off: ISIZE only holds the
+ * size mod 2^32, and outside BGZF member boundaries are found by searching
+ * for headers behind a plausible trailer, which compressed data can imitate.
+ */
+#define GZIP_SIZE_WRAPPED 0x1 // a member over 4 MiB, may hold 4 GiB or more
+#define GZIP_SIZE_GUESSED 0x2 // concatenated members, boundaries not verified
+int gzip_file_size(const char *infile_name, size_t *output_length,
+                   int *size_flags);
+// thread_num > 1 inflates as decompress_file_mt does
+int decompress_file_opts(const char *infile_name, unsigned char *output_string,
+                         size_t output_capacity, size_t *output_length,
+                         const igzip_options *opts);
+// inflate into a buffer sized from ISIZE, allocated once; release with igzip_free()
+int decompress_file_alloc(const char *infile_name,
+                          unsigned char **output_string,
+                          size_t *output_length, int thread_num);
+
+/*
+ * Constant memory inflate: output is handed to sink in chunk_size pieces
+ * (the last one shorter) instead of landing in one buffer, so files of any
+ * size can be processed. A non-zero return from sink stops decompression.
+ */
+typedef int (*decompress_sink)(void *opaque, const unsigned char *data,
+                               size_t length);
+int decompress_file_stream(const char *infile_name, size_t chunk_size,
+                           decompress_sink sink, void *opaque,
+                           size_t *output_length);
 
 /* igzip deflate wrapper */
+// the context is kept per calling thread and reused by its next call
 int compress_file(unsigned char *input_string, size_t input_length,
                   const char *outfile_name, int compress_level, int thread_num);
+/*
+ * Destroy the calling thread's cached context, its pool threads and
+ * buffers. It is otherwise kept until the thread exits; long lived threads
+ * that are done compressing, such as those of a server's pool, call this
+ * to give the memory back. The next call simply builds a new one.
+ */
+void compress_cache_release(void);
+// with opts tuned to input_length, on a context of its own
+int compress_file_opts(unsigned char *input_string, size_t input_length,
+                       const char *outfile_name, const igzip_options *opts);
+// memory to memory, returns BUFFER_TOO_SMALL when output_capacity runs out;
+// shares the per-thread context of compress_file
+int compress_buffer(unsigned char *input_string, size_t input_length,
+                    unsigned char *output_string, size_t output_capacity,
+                    size_t *output_length, int compress_level, int thread_num);
+// worst case compressed size of input_length bytes, in any output mode
+size_t compress_bound(size_t input_length);
+
+/*
+ * Reusable deflate context: owns the worker pool, job queue and level
+ * buffers so repeated compressions skip thread startup and allocations.
+ * One context serves one call at a time; use a context per caller thread.
+ */
+typedef struct _compress_ctx compress_ctx;
+compress_ctx *compress_ctx_create(int compress_level, int thread_num);
+compress_ctx *compress_ctx_create_opts(const igzip_options *opts);
+// compress_ctx flags, set between calls
+#define COMPRESS_DICT_CHAIN 0x1 // prime parallel blocks with the prior 32 KiB
+#define COMPRESS_BGZF 0x2 // one gzip member per block, sizes in EXTRA (BGZF)
+#define COMPRESS_DIRECT_IO 0x4 // O_DIRECT output to regular files, bypassing the page cache
+#define COMPRESS_RAW 0x8 // batch records as bare deflate streams, no gzip framing
+// per block level up to the context's from a sample of its bytes, stored
+// blocks for incompressible data; not for single thread compress_stream
+#define COMPRESS_ADAPTIVE 0x10
+int compress_ctx_set_flags(compress_ctx *ctx, int flags);
+// fill stats on every following call (a stream on its finish), NULL to stop
+int compress_ctx_set_stats(compress_ctx *ctx, igzip_stats *stats);
+int compress_file_ctx(compress_ctx *ctx, unsigned char *input_string,
+                      size_t input_length, const char *outfile_name);
+// to an open descriptor (file, pipe or socket), which stays open
+int compress_fd_ctx(compress_ctx *ctx, unsigned char *input_string,
+                    size_t input_length, int fd);
+int compress_buffer_ctx(compress_ctx *ctx, unsigned char *input_string,
+                        size_t input_length, unsigned char *output_string,
+                        size_t output_capacity, size_t *output_length);
+/*
+ * Batch of small independent records, spread over the context's threads.
+ * Each record becomes a complete gzip member (a raw deflate stream with
+ * COMPRESS_RAW) in its own output, sized with compress_bound. Returns 1 if
+ * any record failed; status is 0, or BUFFER_TOO_SMALL when its output ran
+ * out of room. A context with COMPRESS_BGZF or COMPRESS_ADAPTIVE set is
+ * refused with 1 and no record touched.
+ */
+typedef struct _compress_record {
+  unsigned char *input;
+  size_t input_length;
+  unsigned char *output;
+  size_t output_capacity;
+  size_t output_length; // set by the call
+  int status;           // set by the call
+} compress_record;
+int compress_batch_ctx(compress_ctx *ctx, compress_record *records,
+                       size_t count);
+// file to file, a regular infile_name is mapped rather than read
+int compress_file_from_file(compress_ctx *ctx, const char *infile_name,
+                            const char *outfile_name);
+void compress_ctx_destroy(compress_ctx *ctx);
+
+/*
+ * Streaming compressor: chunks of any size are pushed as they are produced
+ * and compressed output reaches outfile_name continuously. The stream
+ * borrows ctx, which serves nothing else until compress_stream_finish.
+ */
+typedef struct _compress_stream compress_stream;
+compress_stream *compress_stream_open(compress_ctx *ctx,
+                                      const char *outfile_name);
+int compress_stream_write(compress_stream *stream, unsigned char *data,
+                          size_t length);
+// push out everything written so far, so a reader can decode all of it
+int compress_stream_flush(compress_stream *stream);
+// write the trailer, close the output and free the stream
+int compress_stream_finish(compress_stream *stream);
+
+/*
+ * Random access index: checkpoints every span uncompressed bytes where
+ * inflate can restart, each with the 32 KiB window it needs. Build one from
+ * an existing file with a full inflate (member starts, and the first block
+ * boundary found once a point is due), or attach one to a compress_ctx to
+ * record block boundaries while compressing.
+ */
+typedef struct _gzip_index gzip_index;
+gzip_index *gzip_index_create(size_t span);
+gzip_index *gzip_index_build(const char *infile_name, size_t span);
+// record checkpoints on the next compress_file_ctx calls, NULL to stop
+int compress_ctx_set_index(compress_ctx *ctx, gzip_index *index);
+int gzip_index_save(const gzip_index *index, const char *index_file_name);
+gzip_index *gzip_index_load(const char *index_file_name);
+// inflate [offset, offset + length) of infile_name, starting from a checkpoint
+int gzip_index_read(const gzip_index *index, const char *infile_name,
+                    size_t offset, unsigned char *output_string, size_t length,
+                    size_t *output_length);
+void gzip_index_free(gzip_index *index);
+// used by the compressor: where the next point is due, and adding one
+size_t gzip_index_next_point(const gzip_index *index);
+int gzip_index_add_point(gzip_index *index, uint64_t in_offset,
+                         uint64_t out_offset, const unsigned char *window,
+                         uint32_t window_len, int member_start);
 
 #ifdef __cplusplus
 } // extern "C"
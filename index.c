@@ -0,0 +1,448 @@
+#include "igzip_wrapper.h"
+/* Normally you use isa-l.h instead for external programs */
+#include "isa-l/igzip_lib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INDEX_MAGIC "IGZIDX01"
+#define INDEX_MAGIC_LEN 8
+#define INDEX_WINDOW_SIZE IGZIP_HIST_SIZE
+#define INDEX_MEMBER_START 0x1 // point is a gzip header, not raw deflate
+#define GZIP_TRAILER_SIZE 8
+// Input handed to isal_inflate at once while waiting for a block boundary
+#define INDEX_PROBE_SIZE 16
+
+/*
+ * A checkpoint where inflate can start afresh. Points either sit on a gzip
+ * member header or on a deflate block boundary inside a member, any bit of a
+ * byte, in which case window holds the history matches may still refer to.
+ */
+struct gzip_index_point {
+  uint64_t in_bit_offset;
+  uint64_t out_offset;
+  uint32_t flags;
+  uint32_t window_len;
+  unsigned char *window;
+};
+
+struct _gzip_index {
+  size_t span;
+  size_t count;
+  size_t capacity;
+  struct gzip_index_point *points;
+};
+
+gzip_index *gzip_index_create(size_t span) {
+  gzip_index *index = (gzip_index *)malloc_safe(sizeof(gzip_index));
+  index->span = span > 0 ? span : BLOCK_SIZE;
+  index->count = 0;
+  index->capacity = 0;
+  index->points = NULL;
+  return index;
+}
+
+void gzip_index_free(gzip_index *index) {
+  size_t i;
+  if (index == NULL)
+    return;
+  for (i = 0; i < index->count; i++)
+    igzip_free(index->points[i].window);
+  igzip_free(index->points);
+  igzip_free(index);
+}
+
+size_t gzip_index_next_point(const gzip_index *index) {
+  if (index->count == 0)
+    return 0;
+  return index->points[index->count - 1].out_offset + index->span;
+}
+
+static int index_add_point(gzip_index *index, uint64_t in_bit_offset,
+                           uint64_t out_offset, const unsigned char *window,
+                           uint32_t window_len, int member_start) {
+  struct gzip_index_point *point;
+  size_t i;
+
+  // A point at the very start means a new stream is being indexed
+  if (out_offset == 0 && in_bit_offset == 0) {
+    for (i = 0; i < index->count; i++)
+      igzip_free(index->points[i].window);
+    index->count = 0;
+  } else if (index->count > 0 &&
+             out_offset < gzip_index_next_point(index)) {
+    return 0; // not due yet
+  }
+
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 64;
+    index->points = (struct gzip_index_point *)realloc_safe(
+        index->points, index->capacity * sizeof(struct gzip_index_point),
+        capacity * sizeof(struct gzip_index_point));
+    index->capacity = capacity;
+  }
+
+  if (window_len > INDEX_WINDOW_SIZE) {
+    window += window_len - INDEX_WINDOW_SIZE;
+    window_len = INDEX_WINDOW_SIZE;
+  }
+  point = &index->points[index->count++];
+  point->in_bit_offset = in_bit_offset;
+  point->out_offset = out_offset;
+  point->flags = member_start ? INDEX_MEMBER_START : 0;
+  point->window_len = window_len;
+  point->window = (unsigned char *)malloc_safe(window_len);
+  if (window_len > 0)
+    memcpy(point->window, window, window_len);
+  return 0;
+}
+
+int gzip_index_add_point(gzip_index *index, uint64_t in_offset,
+                         uint64_t out_offset, const unsigned char *window,
+                         uint32_t window_len, int member_start) {
+  return index_add_point(index, in_offset * 8, out_offset, window, window_len,
+                         member_start);
+}
+
+gzip_index *gzip_index_build(const char *infile_name, size_t span) {
+  FILE *in = NULL;
+  unsigned char *inbuf = NULL, *outbuf = NULL;
+  struct inflate_state *state = NULL;
+  gzip_index *index = NULL;
+  uint64_t in_read = 0, total_out = 0, member_out;
+  size_t out_pos = 0;
+  int ret, success = 0;
+
+  open_in_file(&in, infile_name);
+  if (in == NULL)
+    return NULL;
+
+  index = gzip_index_create(span);
+  inbuf = (unsigned char *)cache_alloc(BLOCK_SIZE);
+  outbuf = (unsigned char *)cache_alloc(BLOCK_SIZE);
+  state = (struct inflate_state *)cache_alloc(sizeof(struct inflate_state));
+  state->avail_in = 0;
+  state->next_in = inbuf;
+
+  /*
+   * Every member start is a point. Inside a member, once a point is due,
+   * input goes in INDEX_PROBE_SIZE bytes at a time so that isal_inflate
+   * returns while reading the next block header; there the block boundary
+   * is at the bits not consumed yet. The output is kept contiguous in
+   * outbuf, sliding its last 32 KiB to the front, to copy the window.
+   */
+  for (;;) {
+    if (state->avail_in < 2 && !feof(in)) {
+      memmove(inbuf, state->next_in, state->avail_in);
+      state->next_in = inbuf;
+      size_t got = fread_safe(inbuf + state->avail_in, 1,
+                              BLOCK_SIZE - state->avail_in, in, infile_name);
+      state->avail_in += got;
+      in_read += got;
+    }
+    // Follows the gzread() decision whether to treat as trailing junk
+    if (state->avail_in < 2 || state->next_in[0] != 31 ||
+        state->next_in[1] != 139)
+      break;
+
+    gzip_index_add_point(index, in_read - state->avail_in, total_out, NULL, 0,
+                         1);
+
+    unsigned char *next_in = state->next_in;
+    uint32_t avail_in = state->avail_in;
+    isal_inflate_init(state);
+    state->next_in = next_in;
+    state->avail_in = avail_in;
+    state->crc_flag = ISAL_GZIP;
+    member_out = 0;
+    do {
+      if (state->avail_in == 0 && !feof(in)) {
+        state->next_in = inbuf;
+        state->avail_in = fread_safe(inbuf, 1, BLOCK_SIZE, in, infile_name);
+        in_read += state->avail_in;
+      }
+      if (BLOCK_SIZE - out_pos < INDEX_WINDOW_SIZE) {
+        memmove(outbuf, outbuf + out_pos - INDEX_WINDOW_SIZE,
+                INDEX_WINDOW_SIZE);
+        out_pos = INDEX_WINDOW_SIZE;
+      }
+      state->next_out = outbuf + out_pos;
+      state->avail_out = BLOCK_SIZE - out_pos;
+
+      // The rest of the buffer is held back while probing
+      int probe = total_out >= gzip_index_next_point(index);
+      uint32_t held = probe && state->avail_in > INDEX_PROBE_SIZE
+                          ? state->avail_in - INDEX_PROBE_SIZE
+                          : 0;
+      state->avail_in -= held;
+      ret = isal_inflate(state);
+      state->avail_in += held;
+      if (ret != ISAL_DECOMP_OK) {
+        log_print(ERROR, "igzip: Error encountered while indexing file %s\n",
+                  infile_name);
+        goto gzip_index_build_cleanup;
+      }
+      size_t produced = state->next_out - (outbuf + out_pos);
+      out_pos += produced;
+      total_out += produced;
+      member_out += produced;
+
+      // Past the member's first block, not in its gzip header
+      if (probe && member_out > 0 &&
+          (state->block_state == ISAL_BLOCK_NEW_HDR ||
+           state->block_state == ISAL_BLOCK_HDR)) {
+        // An incomplete header waits in tmp_in_buffer, unconsumed as well
+        uint64_t bit = (in_read - state->avail_in - state->tmp_in_size) * 8 -
+                       state->read_in_length;
+        uint32_t window_len = member_out < INDEX_WINDOW_SIZE
+                                  ? (uint32_t)member_out
+                                  : INDEX_WINDOW_SIZE;
+        index_add_point(index, bit, total_out, outbuf + out_pos - window_len,
+                        window_len, 0);
+      }
+    } while (state->block_state != ISAL_BLOCK_FINISH &&
+             (!feof(in) || state->avail_in > 0 || state->avail_out == 0));
+
+    if (state->block_state != ISAL_BLOCK_FINISH) {
+      log_print(ERROR,
+                "igzip: Error %s does not contain a complete gzip file\n",
+                infile_name);
+      goto gzip_index_build_cleanup;
+    }
+  }
+  success = index->count > 0;
+
+gzip_index_build_cleanup:
+
+  if (in != NULL && in != stdin)
+    fclose(in);
+  cache_free(inbuf, BLOCK_SIZE);
+  cache_free(outbuf, BLOCK_SIZE);
+  cache_free(state, sizeof(struct inflate_state));
+  if (!success) {
+    gzip_index_free(index);
+    return NULL;
+  }
+  return index;
+}
+
+int gzip_index_save(const gzip_index *index, const char *index_file_name) {
+  FILE *out = fopen_safe(index_file_name, "wb");
+  uint64_t span = index->span, count = index->count;
+  size_t i;
+
+  if (out == NULL)
+    return 1;
+
+  // Little endian fields, like the gzip trailer we write
+  fwrite_safe((void *)INDEX_MAGIC, 1, INDEX_MAGIC_LEN, out, index_file_name);
+  fwrite_safe(&span, sizeof(uint64_t), 1, out, index_file_name);
+  fwrite_safe(&count, sizeof(uint64_t), 1, out, index_file_name);
+  for (i = 0; i < index->count; i++) {
+    struct gzip_index_point *point = &index->points[i];
+    fwrite_safe(&point->in_bit_offset, sizeof(uint64_t), 1, out,
+                index_file_name);
+    fwrite_safe(&point->out_offset, sizeof(uint64_t), 1, out,
+                index_file_name);
+    fwrite_safe(&point->flags, sizeof(uint32_t), 1, out, index_file_name);
+    fwrite_safe(&point->window_len, sizeof(uint32_t), 1, out,
+                index_file_name);
+    fwrite_safe(point->window, 1, point->window_len, out, index_file_name);
+  }
+
+  fclose(out);
+  return 0;
+}
+
+gzip_index *gzip_index_load(const char *index_file_name) {
+  FILE *in = fopen_safe(index_file_name, "rb");
+  char magic[INDEX_MAGIC_LEN];
+  uint64_t span, count, i;
+  gzip_index *index;
+
+  if (in == NULL)
+    return NULL;
+
+  if (fread_safe(magic, 1, INDEX_MAGIC_LEN, in, index_file_name) !=
+          INDEX_MAGIC_LEN ||
+      memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0 ||
+      fread_safe(&span, sizeof(uint64_t), 1, in, index_file_name) != 1 ||
+      fread_safe(&count, sizeof(uint64_t), 1, in, index_file_name) != 1) {
+    log_print(ERROR, "igzip: %s is not a gzip index\n", index_file_name);
+    fclose(in);
+    return NULL;
+  }
+
+  index = gzip_index_create(span);
+  for (i = 0; i < count; i++) {
+    struct gzip_index_point point;
+    if (fread_safe(&point.in_bit_offset, sizeof(uint64_t), 1, in,
+                   index_file_name) != 1 ||
+        fread_safe(&point.out_offset, sizeof(uint64_t), 1, in,
+                   index_file_name) != 1 ||
+        fread_safe(&point.flags, sizeof(uint32_t), 1, in, index_file_name) !=
+            1 ||
+        fread_safe(&point.window_len, sizeof(uint32_t), 1, in,
+                   index_file_name) != 1 ||
+        point.window_len > INDEX_WINDOW_SIZE)
+      goto gzip_index_load_error;
+
+    unsigned char window[INDEX_WINDOW_SIZE];
+    if (fread_safe(window, 1, point.window_len, in, index_file_name) !=
+        point.window_len)
+      goto gzip_index_load_error;
+
+    // Keep the points as saved, even where they are closer than span
+    size_t keep_span = index->span;
+    index->span = 0;
+    index_add_point(index, point.in_bit_offset, point.out_offset, window,
+                    point.window_len, point.flags & INDEX_MEMBER_START);
+    index->span = keep_span;
+  }
+
+  fclose(in);
+  return index;
+
+gzip_index_load_error:
+  log_print(ERROR, "igzip: Truncated or corrupt gzip index %s\n",
+            index_file_name);
+  gzip_index_free(index);
+  fclose(in);
+  return NULL;
+}
+
+int gzip_index_read(const gzip_index *index, const char *infile_name,
+                    size_t offset, unsigned char *output_string, size_t length,
+                    size_t *output_length) {
+  FILE *in = NULL;
+  unsigned char *inbuf = NULL, *scratch = NULL;
+  struct inflate_state *state = NULL;
+  struct gzip_index_point *point = NULL;
+  size_t lo = 0, hi, skip, got = 0;
+  uint32_t trailer_left = 0;
+  int ret, success = 0, raw;
+
+  *output_length = 0;
+  if (index == NULL || index->count == 0 || output_string == NULL)
+    return 1;
+
+  // Last point at or before offset
+  hi = index->count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->points[mid].out_offset <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  point = &index->points[lo];
+
+  open_in_file(&in, infile_name);
+  if (in == NULL)
+    return 1;
+  if (fseeko(in, point->in_bit_offset / 8, SEEK_SET) != 0) {
+    log_print(ERROR, "igzip: Failed to seek in %s\n", infile_name);
+    goto gzip_index_read_cleanup;
+  }
+
+  inbuf = (unsigned char *)cache_alloc(BLOCK_SIZE);
+  scratch = (unsigned char *)cache_alloc(BLOCK_SIZE);
+  state = (struct inflate_state *)cache_alloc(sizeof(struct inflate_state));
+  skip = offset - point->out_offset;
+  raw = !(point->flags & INDEX_MEMBER_START);
+
+  isal_inflate_init(state);
+  state->crc_flag = raw ? ISAL_DEFLATE : ISAL_GZIP;
+  if (raw && point->window_len > 0)
+    isal_inflate_set_dict(state, point->window, point->window_len);
+  state->next_in = inbuf;
+  state->avail_in = 0;
+  if (point->in_bit_offset % 8 != 0) {
+    // The block starts inside this byte, its low bits belong to the last one
+    int bits = point->in_bit_offset % 8, byte = fgetc(in);
+    if (byte == EOF) {
+      log_print(ERROR, "igzip: Failed to read %s\n", infile_name);
+      goto gzip_index_read_cleanup;
+    }
+    state->read_in = (uint64_t)byte >> bits;
+    state->read_in_length = 8 - bits;
+  }
+
+  while (got < length) {
+    if (state->avail_in == 0) {
+      if (feof(in))
+        break;
+      state->next_in = inbuf;
+      state->avail_in = fread_safe(inbuf, 1, BLOCK_SIZE, in, infile_name);
+      if (state->avail_in == 0)
+        break;
+    }
+
+    if (trailer_left > 0) {
+      // Raw deflate from a mid-member point leaves the trailer to skip
+      uint32_t n = state->avail_in < trailer_left ? state->avail_in : trailer_left;
+      state->next_in += n;
+      state->avail_in -= n;
+      trailer_left -= n;
+      continue;
+    }
+
+    if (state->block_state == ISAL_BLOCK_FINISH) {
+      if (state->avail_in < 2 && !feof(in)) {
+        memmove(inbuf, state->next_in, state->avail_in);
+        state->next_in = inbuf;
+        state->avail_in += fread_safe(inbuf + state->avail_in, 1,
+                                     BLOCK_SIZE - state->avail_in, in,
+                                     infile_name);
+      }
+      if (state->avail_in < 2 || state->next_in[0] != 31 ||
+          state->next_in[1] != 139)
+        break; // end of the gzip data
+      isal_inflate_reset(state);
+      state->crc_flag = ISAL_GZIP;
+    }
+
+    if (skip > 0) {
+      state->next_out = scratch;
+      state->avail_out = skip < BLOCK_SIZE ? skip : BLOCK_SIZE;
+    } else {
+      state->next_out = output_string + got;
+      state->avail_out =
+          length - got < BLOCK_SIZE ? length - got : BLOCK_SIZE;
+    }
+    unsigned char *out_start = state->next_out;
+
+    ret = isal_inflate(state);
+    if (ret != ISAL_DECOMP_OK) {
+      log_print(ERROR, "igzip: Error encountered while decompressing file %s\n",
+                infile_name);
+      goto gzip_index_read_cleanup;
+    }
+
+    if (skip > 0)
+      skip -= state->next_out - out_start;
+    else
+      got += state->next_out - out_start;
+
+    if (state->block_state == ISAL_BLOCK_FINISH && raw) {
+      trailer_left = GZIP_TRAILER_SIZE;
+      raw = 0;
+    }
+  }
+  success = 1;
+
+gzip_index_read_cleanup:
+
+  if (in != NULL && in != stdin)
+    fclose(in);
+  cache_free(inbuf, BLOCK_SIZE);
+  cache_free(scratch, BLOCK_SIZE);
+  cache_free(state, sizeof(struct inflate_state));
+  *output_length = got;
+  return (success == 0);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -2,39 +2,615 @@
 /* Normally you use isa-l.h instead for external programs */
 #include "isa-l/igzip_lib.h"
 
+#if defined(HAVE_THREADS)
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int decompress_file(const char *infile_name, unsigned char *output_string,
-                    size_t *output_length) {
+// Largest avail_in/avail_out handed to isal_inflate in one call
+#define MAX_INFLATE_CHUNK (1u << 30)
+// Smallest gzip member: 10 byte header, empty final block, 8 byte trailer
+#define MIN_MEMBER_SIZE 20
+/*
+ * Deflate expands at most about 1032:1, so a member under 4 MiB compressed
+ * can't hold 4 GiB and its ISIZE is exact. Past that a wrap is only
+ * possible, and nothing short of inflating tells.
+ */
+#define MAX_DEFLATE_RATIO 1032
+// Input between checks of the stop flag when inflating members in parallel
+#define CANCEL_CHUNK (1u << 20)
+
+#if defined(HAVE_THREADS)
+typedef _Atomic int cancel_flag;
+#define CANCELLED(flag)                                                        \
+  ((flag) != NULL && atomic_load_explicit((flag), memory_order_relaxed))
+#else
+typedef int cancel_flag;
+#define CANCELLED(flag) ((flag) != NULL && *(flag))
+#endif
+
+/*
+ * Run isal_inflate once, writing straight into output_string at
+ * *total_inflated. Producing more bytes than output_capacity can hold is
+ * reported as ISAL_OUT_OVERFLOW. The time it took is added to *inflate_ns.
+ */
+static int inflate_step(struct inflate_state *state,
+                        unsigned char *output_string, size_t output_capacity,
+                        size_t *total_inflated, uint64_t *inflate_ns) {
+  unsigned char overflow;
+  uint64_t start = igzip_clock_ns();
+  int ret;
+
+  size_t room = output_capacity - *total_inflated;
+  if (room == 0) {
+    // Probe with a scratch byte so trailer-only progress is still possible
+    state->next_out = &overflow;
+    state->avail_out = 1;
+  } else {
+    state->next_out = &output_string[*total_inflated];
+    state->avail_out = room < MAX_INFLATE_CHUNK ? room : MAX_INFLATE_CHUNK;
+  }
+
+  TRACE_BEGIN(TRACE_INFLATE, state->avail_in);
+  ret = isal_inflate(state);
+  TRACE_END(TRACE_INFLATE);
+  *inflate_ns += igzip_clock_ns() - start;
+  if (ret != ISAL_DECOMP_OK)
+    return ret;
+
+  if (room == 0) {
+    if (state->next_out != &overflow)
+      return ISAL_OUT_OVERFLOW;
+  } else {
+    *total_inflated += state->next_out - &output_string[*total_inflated];
+  }
+  return ISAL_DECOMP_OK;
+}
+
+/*
+ * Inflate one gzip member straight into output_string at *total_inflated,
+ * taking the next buffer read ahead from the file as needed.
+ */
+static int inflate_member(struct inflate_state *state, async_io *in,
+                          unsigned char *output_string, size_t output_capacity,
+                          size_t *total_inflated, uint64_t *inflate_ns) {
+  size_t length;
+  int ret;
+
+  do {
+    if (state->avail_in == 0 && !async_eof(in)) {
+      state->next_in = async_read(in, &length);
+      state->avail_in = length;
+    }
+
+    ret = inflate_step(state, output_string, output_capacity, total_inflated,
+                       inflate_ns);
+    if (ret != ISAL_DECOMP_OK)
+      return ret;
+
+  } while (state->block_state != ISAL_BLOCK_FINISH    // while not done
+           && (!async_eof(in) || state->avail_out == 0) // and work to do
+  );
+
+  return ISAL_DECOMP_OK;
+}
+
+/*
+ * Inflate the gzip member at the start of an in-memory buffer, header and
+ * trailer included. *in_used reports how many input bytes it spanned. With
+ * a cancel flag the input goes in smaller slices, and once the flag is set
+ * the member is left unfinished.
+ */
+static int inflate_member_mem(struct inflate_state *state, unsigned char *in,
+                              size_t in_length, size_t *in_used,
+                              unsigned char *output_string,
+                              size_t output_capacity, size_t *total_inflated,
+                              uint64_t *inflate_ns, cancel_flag *cancel) {
+  size_t in_pos = 0;
+  size_t chunk = cancel != NULL ? CANCEL_CHUNK : MAX_INFLATE_CHUNK;
+  int ret;
+
+  isal_inflate_init(state);
+  state->crc_flag = ISAL_GZIP; // Let isal_inflate() process the header
+  state->avail_in = 0;
+
+  do {
+    if (state->avail_in == 0) {
+      size_t left = in_length - in_pos;
+      state->next_in = in + in_pos;
+      state->avail_in = left < chunk ? left : chunk;
+      in_pos += state->avail_in;
+    }
+
+    ret = inflate_step(state, output_string, output_capacity, total_inflated,
+                       inflate_ns);
+    if (ret != ISAL_DECOMP_OK || CANCELLED(cancel))
+      break;
+
+  } while (state->block_state != ISAL_BLOCK_FINISH &&
+           (in_pos < in_length || state->avail_in > 0 ||
+            state->avail_out == 0));
+
+  *in_used = in_pos - state->avail_in;
+  if (ret == ISAL_DECOMP_OK && state->block_state != ISAL_BLOCK_FINISH)
+    ret = ISAL_END_INPUT; // truncated member
+  return ret;
+}
+
+// Sequentially inflate every concatenated member held in memory
+static int inflate_members_mem(unsigned char *in, size_t in_length,
+                               unsigned char *output_string,
+                               size_t output_capacity, size_t *total_inflated,
+                               uint64_t *inflate_ns) {
+  struct inflate_state *state =
+      (struct inflate_state *)cache_alloc(sizeof(struct inflate_state));
+  size_t in_pos = 0, in_used;
+  int ret;
+
+  do {
+    ret = inflate_member_mem(state, in + in_pos, in_length - in_pos,
+                             &in_used, output_string, output_capacity,
+                             total_inflated, inflate_ns, NULL);
+    if (ret != ISAL_DECOMP_OK)
+      break;
+    in_pos += in_used;
+    // Follows the gzread() decision whether to treat as trailing junk
+  } while (in_length - in_pos >= 2 && in[in_pos] == 31 &&
+           in[in_pos + 1] == 139);
+
+  cache_free(state, sizeof(struct inflate_state));
+  return ret;
+}
+
+/*
+ * Sequentially inflate every member into a buffer grown whenever it fills.
+ * The output so far stays right behind next_out across the realloc, so
+ * isal_inflate carries on mid-member where it stopped.
+ */
+static int inflate_members_grow(unsigned char *in, size_t in_length,
+                                unsigned char **output_string,
+                                size_t *output_capacity,
+                                size_t *total_inflated, uint64_t *inflate_ns) {
+  struct inflate_state *state =
+      (struct inflate_state *)cache_alloc(sizeof(struct inflate_state));
+  size_t in_pos = 0;
+  int ret;
+
+  do {
+    isal_inflate_init(state);
+    state->crc_flag = ISAL_GZIP; // Let isal_inflate() process the header
+    state->avail_in = 0;
+    do {
+      if (state->avail_in == 0) {
+        size_t left = in_length - in_pos;
+        state->next_in = in + in_pos;
+        state->avail_in = left < MAX_INFLATE_CHUNK ? left : MAX_INFLATE_CHUNK;
+        in_pos += state->avail_in;
+      }
+      if (*total_inflated == *output_capacity) {
+        size_t grown = *output_capacity + (*output_capacity / 2 > BLOCK_SIZE
+                                               ? *output_capacity / 2
+                                               : BLOCK_SIZE);
+        *output_string = (unsigned char *)realloc_safe(
+            *output_string, *output_capacity, grown);
+        *output_capacity = grown;
+      }
+
+      ret = inflate_step(state, *output_string, *output_capacity,
+                         total_inflated, inflate_ns);
+      if (ret != ISAL_DECOMP_OK)
+        break;
+
+    } while (state->block_state != ISAL_BLOCK_FINISH &&
+             (in_pos < in_length || state->avail_in > 0 ||
+              state->avail_out == 0));
+
+    if (ret == ISAL_DECOMP_OK && state->block_state != ISAL_BLOCK_FINISH)
+      ret = ISAL_END_INPUT; // truncated member
+    if (ret != ISAL_DECOMP_OK)
+      break;
+    in_pos -= state->avail_in;
+  } while (in_length - in_pos >= 2 && in[in_pos] == 31 &&
+           in[in_pos + 1] == 139);
+
+  cache_free(state, sizeof(struct inflate_state));
+  return ret;
+}
+
+/*
+ * Length of a well formed gzip header at p, or 0 if there is none. Used to
+ * find candidate member boundaries without inflating anything.
+ */
+static size_t gzip_header_length(const unsigned char *p, size_t avail) {
+  size_t len = 10;
+  if (avail < len || p[0] != 31 || p[1] != 139 || p[2] != 8 ||
+      (p[3] & 0xe0) != 0)
+    return 0;
+
+  if (p[3] & 4) { // FEXTRA
+    if (avail < len + 2)
+      return 0;
+    len += 2 + (p[len] | (p[len + 1] << 8));
+  }
+  if (p[3] & 8) { // FNAME
+    while (len < avail && p[len] != 0)
+      len++;
+    len++;
+  }
+  if (p[3] & 16) { // FCOMMENT
+    while (len < avail && p[len] != 0)
+      len++;
+    len++;
+  }
+  if (p[3] & 2) // FHCRC
+    len += 2;
+  return len <= avail ? len : 0;
+}
+
+/*
+ * Size of the BGZF block at p as recorded in its 'BC' EXTRA subfield, or 0
+ * if the member carries none.
+ */
+static size_t bgzf_block_length(const unsigned char *p, size_t avail) {
+  size_t pos, end;
+  if (gzip_header_length(p, avail) == 0 || !(p[3] & 4))
+    return 0;
+
+  end = 12 + (p[10] | (p[11] << 8));
+  for (pos = 12; pos + 4 <= end; pos += 4 + (p[pos + 2] | (p[pos + 3] << 8))) {
+    if (p[pos] == 'B' && p[pos + 1] == 'C' && p[pos + 2] == 2 &&
+        p[pos + 3] == 0 && pos + 6 <= end)
+      return (size_t)(p[pos + 4] | (p[pos + 5] << 8)) + 1;
+  }
+  return 0;
+}
+
+// Little endian 32 bit value, as gzip trailers store them
+static size_t trailer_word(const unsigned char *p) {
+  return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) |
+         ((size_t)p[3] << 24);
+}
+
+struct gzip_member {
+  size_t in_offset;
+  size_t in_length;
+  size_t out_offset;
+  size_t out_length; // from ISIZE, so only exact below 4 GiB
+};
+
+// Whether a member of length bytes could inflate to isize (mod 2^32)
+static int isize_possible(size_t length, size_t isize) {
+  uint64_t most = (uint64_t)length * MAX_DEFLATE_RATIO;
+  return most >= ((uint64_t)1 << 32) || isize <= most;
+}
+
+// Offset of the first position from pos on that looks like a member header
+static size_t find_header(unsigned char *in, size_t pos, size_t in_length) {
+  while (pos < in_length) {
+    unsigned char *hit = (unsigned char *)memchr(in + pos, 31, in_length - pos);
+    if (hit == NULL)
+      return in_length;
+    pos = hit - in;
+    if (gzip_header_length(hit, in_length - pos) != 0)
+      return pos;
+    pos++;
+  }
+  return in_length;
+}
+
+/*
+ * Split a concatenated gzip buffer into members. BGZF blocks state their
+ * own size; elsewhere the split is at every position that looks like a
+ * member header and follows a trailer whose ISIZE the member could have.
+ * That is speculative since both can occur inside compressed data, so
+ * members are validated once inflated.
+ */
+static size_t scan_members(unsigned char *in, size_t in_length,
+                           struct gzip_member **members) {
+  size_t count = 0, capacity = 64;
+  size_t pos = 0, next;
+  struct gzip_member *list = (struct gzip_member *)malloc_safe(
+      capacity * sizeof(struct gzip_member));
+
+  while (pos < in_length) {
+    size_t bsize = bgzf_block_length(in + pos, in_length - pos);
+    if (bsize >= MIN_MEMBER_SIZE && bsize <= in_length - pos)
+      next = pos + bsize;
+    else // look for the next header far enough past the current one
+      next = find_header(in, pos + MIN_MEMBER_SIZE, in_length);
+    while (next < in_length &&
+           !isize_possible(next - pos, trailer_word(in + next - 4)))
+      next = find_header(in, next + 1, in_length);
+    if (next > in_length)
+      next = in_length;
+
+    if (count == capacity) {
+      list = (struct gzip_member *)realloc_safe(
+          list, capacity * sizeof(struct gzip_member),
+          2 * capacity * sizeof(struct gzip_member));
+      capacity *= 2;
+    }
+    list[count].in_offset = pos;
+    list[count].in_length = next - pos;
+    list[count].out_length = 0;
+    if (next - pos >= MIN_MEMBER_SIZE)
+      list[count].out_length = trailer_word(in + next - 4);
+    count++;
+    pos = next;
+  }
+
+  *members = list;
+  return count;
+}
+
+#if defined(HAVE_THREADS)
+
+// One thread inflating members of a job, with its own times
+struct inflate_thread {
+  struct parallel_inflate *job;
+  uint64_t inflate_ns;
+  uint64_t busy_ns;
+};
+
+struct parallel_inflate {
+  unsigned char *in;
+  unsigned char *out;
+  struct gzip_member *members;
+  size_t count;
+  _Atomic size_t next;
+  _Atomic int failed;
+  struct inflate_thread *threads; // pool helpers first, the caller last
+  int helpers;                    // pool threads that may join
+  int joined;                     // the rest is guarded by the pool lock
+  int active;
+  pthread_cond_t idle;            // the last helper has left
+  struct parallel_inflate *next_job;
+};
+
+/*
+ * Process wide pool of inflate threads, started on first use and grown to
+ * the largest thread_num asked for. Idle threads wait on work for a posted
+ * job that still takes helpers, so a call costs no thread creation.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  struct parallel_inflate *jobs;
+  int nthreads;
+} inflate_pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL,
+                  0};
+
+/*
+ * Inflate member i at its precomputed output offset. It must fill exactly
+ * its ISIZE and end where the next member was assumed to start, otherwise
+ * the speculative split was wrong.
+ */
+static int inflate_parallel_member(struct parallel_inflate *job, size_t i,
+                                   uint64_t *inflate_ns) {
+  struct gzip_member *m = &job->members[i];
+  struct inflate_state *state =
+      (struct inflate_state *)cache_alloc(sizeof(struct inflate_state));
+  size_t in_used, produced = 0;
+  int ret;
+
+  ret = inflate_member_mem(state, job->in + m->in_offset, m->in_length,
+                           &in_used, job->out + m->out_offset, m->out_length,
+                           &produced, inflate_ns, &job->failed);
+  cache_free(state, sizeof(struct inflate_state));
+  if (ret != ISAL_DECOMP_OK || produced != m->out_length)
+    return 1;
+  if (in_used == m->in_length)
+    return 0;
+  // only the last member may be followed by trailing junk
+  return i + 1 != job->count || job->in[m->in_offset + in_used] == 31;
+}
+
+// Take members of the job until none are left or one has failed
+static void inflate_job_run(struct inflate_thread *self) {
+  struct parallel_inflate *job = self->job;
+  uint64_t start = igzip_clock_ns();
+  size_t i;
+
+  while (!atomic_load_explicit(&job->failed, memory_order_relaxed) &&
+         (i = atomic_fetch_add(&job->next, 1)) < job->count) {
+    if (inflate_parallel_member(job, i, &self->inflate_ns))
+      atomic_store(&job->failed, 1);
+  }
+  self->busy_ns += igzip_clock_ns() - start;
+}
+
+static void *inflate_pool_thread(void *arg) {
+  (void)arg;
+  TRACE_NAME("inflate");
+  pthread_mutex_lock(&inflate_pool.lock);
+  for (;;) {
+    struct parallel_inflate *job = inflate_pool.jobs;
+    while (job != NULL && job->joined == job->helpers)
+      job = job->next_job;
+    if (job == NULL) {
+      pthread_cond_wait(&inflate_pool.work, &inflate_pool.lock);
+      continue;
+    }
+
+    struct inflate_thread *self = &job->threads[job->joined++];
+    job->active++;
+    pthread_mutex_unlock(&inflate_pool.lock);
+    inflate_job_run(self);
+    pthread_mutex_lock(&inflate_pool.lock);
+    if (--job->active == 0)
+      pthread_cond_signal(&job->idle);
+  }
+  return NULL;
+}
+
+// Post a job to the pool, started or grown to at least its helpers
+static void inflate_pool_post(struct parallel_inflate *job) {
+  pthread_mutex_lock(&inflate_pool.lock);
+  while (inflate_pool.nthreads < job->helpers) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, inflate_pool_thread, NULL) != 0)
+      break; // the caller and the threads there are still do the work
+    pthread_detach(thread);
+    inflate_pool.nthreads++;
+  }
+  job->next_job = inflate_pool.jobs;
+  inflate_pool.jobs = job;
+  pthread_cond_broadcast(&inflate_pool.work);
+  pthread_mutex_unlock(&inflate_pool.lock);
+}
+
+// Take the job back once the caller ran out of members, helpers drained
+static void inflate_pool_finish(struct parallel_inflate *job) {
+  struct parallel_inflate **link;
+  pthread_mutex_lock(&inflate_pool.lock);
+  for (link = &inflate_pool.jobs; *link != job; link = &(*link)->next_job)
+    ;
+  *link = job->next_job;
+  while (job->active > 0)
+    pthread_cond_wait(&job->idle, &inflate_pool.lock);
+  pthread_mutex_unlock(&inflate_pool.lock);
+}
+
+/*
+ * Inflate members concurrently on the caller and the inflate pool, each
+ * straight into its slice of the output. The first member is inflated
+ * before the job is posted, and must end exactly where the second was
+ * assumed to begin, so a stray header pattern in a single member never fans
+ * out. Returns 1 when the split can't be trusted so the caller falls back
+ * to a sequential pass.
+ */
+static int inflate_members_parallel(unsigned char *in, size_t in_length,
+                                    unsigned char *output_string,
+                                    size_t output_capacity,
+                                    size_t *total_inflated, int thread_num,
+                                    igzip_stats *stats) {
+  struct parallel_inflate job;
+  struct inflate_thread *threads;
+  size_t i, out_offset = 0;
+  uint64_t first_ns = 0, start;
+  int nthreads;
+
+  job.count = scan_members(in, in_length, &job.members);
+  for (i = 0; i < job.count; i++) {
+    job.members[i].out_offset = out_offset;
+    out_offset += job.members[i].out_length;
+  }
+  if (job.count < 2 || out_offset > output_capacity) {
+    igzip_free(job.members);
+    return 1;
+  }
+
+  job.in = in;
+  job.out = output_string;
+  atomic_init(&job.next, 1);
+  atomic_init(&job.failed, 0);
+
+  start = igzip_clock_ns();
+  if (inflate_parallel_member(&job, 0, &first_ns)) {
+    stats->inflate_ns += first_ns;
+    igzip_free(job.members);
+    log_print(VERBOSE, "igzip: member split rejected, inflating serially\n");
+    return 1;
+  }
+
+  nthreads = thread_num - 1;
+  if ((size_t)nthreads > job.count - 2)
+    nthreads = job.count - 2;
+  // the last entry is the caller, which takes members too
+  threads = (struct inflate_thread *)malloc_safe((nthreads + 1) *
+                                                 sizeof(struct inflate_thread));
+  memset(threads, 0, (nthreads + 1) * sizeof(struct inflate_thread));
+  for (i = 0; i <= (size_t)nthreads; i++)
+    threads[i].job = &job;
+  threads[nthreads].inflate_ns = first_ns;
+  threads[nthreads].busy_ns = igzip_clock_ns() - start;
+  job.threads = threads;
+  job.helpers = nthreads;
+  job.joined = 0;
+  job.active = 0;
+  pthread_cond_init(&job.idle, NULL);
+  if (nthreads > 0)
+    inflate_pool_post(&job);
+  inflate_job_run(&threads[nthreads]);
+  if (nthreads > 0)
+    inflate_pool_finish(&job);
+  pthread_cond_destroy(&job.idle);
+  for (i = 0; i <= (size_t)nthreads; i++) {
+    stats->inflate_ns += threads[i].inflate_ns;
+    igzip_stats_busy(stats, i, threads[i].busy_ns);
+  }
+  stats->jobs += job.count;
+  igzip_free(threads);
+  igzip_free(job.members);
+
+  if (atomic_load(&job.failed)) {
+    log_print(VERBOSE, "igzip: member split rejected, inflating serially\n");
+    return 1;
+  }
+  *total_inflated = out_offset;
+  return 0;
+}
+
+#endif // defined(HAVE_THREADS)
+
+// Serial inflate of a file, pipes read ahead in depth buffers of io_size
+static int decompress_file_io(const char *infile_name,
+                              unsigned char *output_string,
+                              size_t output_capacity, size_t *output_length,
+                              size_t io_size, int io_depth,
+                              igzip_stats *out_stats) {
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns();
   FILE *in = NULL;
-  unsigned char *inbuf = NULL, *outbuf = NULL;
-  size_t inbuf_size, outbuf_size;
-  struct inflate_state state;
+  async_io *reader = NULL;
+  unsigned char *map = NULL;
+  size_t length, map_length = 0;
+  struct inflate_state *state = NULL;
   struct isal_gzip_header gz_hdr;
   int ret = 0, success = 0;
-
-  size_t infile_name_len = strlen(infile_name);
+  size_t total_inflated = 0;
 
   // Allocate mem and setup to hold gzip header info
   open_in_file(&in, infile_name);
   if (in == NULL)
     goto decompress_file_cleanup;
 
-  inbuf_size = BLOCK_SIZE;
-  outbuf_size = BLOCK_SIZE;
-  inbuf = (unsigned char *)malloc_safe(inbuf_size);
-  outbuf = (unsigned char *)malloc_safe(outbuf_size);
+  // Regular files inflate straight from a mapping, without a stdio copy
+  map = mmap_in_file(in, infile_name, &map_length);
+  if (map != NULL) {
+    if (output_string == NULL) {
+      log_print(ERROR, "igzip: Inflated string buffer for file %s is null\n",
+                infile_name);
+      goto decompress_file_cleanup;
+    }
+    stats.bytes_in = map_length;
+    ret = inflate_members_mem(map, map_length, output_string, output_capacity,
+                              &total_inflated, &stats.inflate_ns);
+    if (ret == ISAL_DECOMP_OK)
+      success = 1;
+    else if (ret != ISAL_OUT_OVERFLOW)
+      log_print(ERROR, "igzip: Error encountered while decompressing file %s\n",
+                infile_name);
+    goto decompress_file_cleanup;
+  }
+
+  // Pipes are read ahead by a helper thread while we inflate
+  reader = async_reader_open(in, infile_name, io_size, io_depth);
+  async_io_set_stats(reader, &stats);
+  state = (struct inflate_state *)cache_alloc(sizeof(struct inflate_state));
 
   isal_gzip_header_init(&gz_hdr);
-  isal_inflate_init(&state);
-  state.crc_flag = ISAL_GZIP_NO_HDR_VER;
-  state.next_in = inbuf;
-  state.avail_in = fread_safe(state.next_in, 1, inbuf_size, in, infile_name);
+  isal_inflate_init(state);
+  state->crc_flag = ISAL_GZIP_NO_HDR_VER;
+  state->next_in = async_read(reader, &length);
+  state->avail_in = length;
 
   // Actually read and save the header info
-  ret = isal_read_gzip_header(&state, &gz_hdr);
+  ret = isal_read_gzip_header(state, &gz_hdr);
   if (ret != ISAL_DECOMP_OK) {
     log_print(ERROR, "igzip: Error invalid gzip header found for file %s\n",
               infile_name);
@@ -47,86 +623,48 @@ int decompress_file(const char *infile_name, unsigned char *output_string,
     goto decompress_file_cleanup;
   }
 
-  size_t total_inflated = 0;
-
   // Start reading in compressed data and decompress
-  do {
-    if (state.avail_in == 0) {
-      state.next_in = inbuf;
-      state.avail_in =
-          fread_safe(state.next_in, 1, inbuf_size, in, infile_name);
-    }
-
-    state.next_out = outbuf;
-    state.avail_out = outbuf_size;
-
-    ret = isal_inflate(&state);
-    if (ret != ISAL_DECOMP_OK) {
+  ret = inflate_member(state, reader, output_string, output_capacity,
+                       &total_inflated, &stats.inflate_ns);
+  if (ret != ISAL_DECOMP_OK) {
+    if (ret != ISAL_OUT_OVERFLOW)
       log_print(ERROR, "igzip: Error encountered while decompressing file %s\n",
                 infile_name);
-      goto decompress_file_cleanup;
-    }
-
-    size_t size_out = state.next_out - outbuf;
-    if (size_out > 0) {
-      memcpy(&output_string[total_inflated], outbuf, size_out);
-      total_inflated += size_out;
-    }
-
-  } while (state.block_state != ISAL_BLOCK_FINISH // while not done
-           && (!feof(in) || state.avail_out == 0) // and work to do
-  );
+    goto decompress_file_cleanup;
+  }
 
   // Add the following to look for and decode additional concatenated files
-  if (!feof(in) && state.avail_in == 0) {
-    state.next_in = inbuf;
-    state.avail_in = fread_safe(state.next_in, 1, inbuf_size, in, infile_name);
+  if (!async_eof(reader) && state->avail_in == 0) {
+    state->next_in = async_read(reader, &length);
+    state->avail_in = length;
   }
 
-  while (state.avail_in > 0 && state.next_in[0] == 31) {
+  while (state->avail_in > 0 && state->next_in[0] == 31) {
     // Look for magic numbers for gzip header. Follows the gzread() decision
     // whether to treat as trailing junk
-    if (state.avail_in > 1 && state.next_in[1] != 139)
+    if (state->avail_in > 1 && state->next_in[1] != 139)
       break;
 
-    isal_inflate_reset(&state);
-    state.crc_flag = ISAL_GZIP; // Let isal_inflate() process extra headers
-    do {
-      if (state.avail_in == 0 && !feof(in)) {
-        state.next_in = inbuf;
-        state.avail_in =
-            fread_safe(state.next_in, 1, inbuf_size, in, infile_name);
-      }
-
-      state.next_out = outbuf;
-      state.avail_out = outbuf_size;
-
-      ret = isal_inflate(&state);
-      if (ret != ISAL_DECOMP_OK) {
+    isal_inflate_reset(state);
+    state->crc_flag = ISAL_GZIP; // Let isal_inflate() process extra headers
+    ret = inflate_member(state, reader, output_string, output_capacity,
+                         &total_inflated, &stats.inflate_ns);
+    if (ret != ISAL_DECOMP_OK) {
+      if (ret != ISAL_OUT_OVERFLOW)
         log_print(ERROR,
                   "igzip: Error while decompressing extra concatenated"
                   "gzip files on %s\n",
                   infile_name);
-        goto decompress_file_cleanup;
-      }
-
-      size_t size_out = state.next_out - outbuf;
-      if (size_out > 0) {
-        memcpy(&output_string[total_inflated], outbuf, size_out);
-        total_inflated += size_out;
-      }
-
-    } while (state.block_state != ISAL_BLOCK_FINISH &&
-             (!feof(in) || state.avail_out == 0));
+      goto decompress_file_cleanup;
+    }
 
-    if (!feof(in) && state.avail_in == 0) {
-      state.next_in = inbuf;
-      state.avail_in =
-          fread_safe(state.next_in, 1, inbuf_size, in, infile_name);
+    if (!async_eof(reader) && state->avail_in == 0) {
+      state->next_in = async_read(reader, &length);
+      state->avail_in = length;
     }
   }
 
-  if (state.block_state != ISAL_BLOCK_FINISH)
+  if (state->block_state != ISAL_BLOCK_FINISH)
     log_print(ERROR, "igzip: Error %s does not contain a complete gzip file\n",
               infile_name);
   else
@@ -134,14 +672,470 @@ int decompress_file(const char *infile_name, unsigned char *output_string,
 
 decompress_file_cleanup:
 
+  cache_free(state, sizeof(struct inflate_state));
+  async_io_close(reader);
   if (in != NULL && in != stdin) {
     fclose(in);
   }
+  if (map != NULL)
+    release_in_file(map, map_length, true);
 
   *output_length = total_inflated;
+  stats.bytes_out = total_inflated;
+  igzip_stats_busy(&stats, 0, stats.inflate_ns);
+  stats.total_ns = igzip_clock_ns() - begin;
+  igzip_stats_commit(&stats, 1, out_stats);
+  if (ret == ISAL_OUT_OVERFLOW) {
+    log_print(ERROR, "igzip: Output buffer too small for file %s\n",
+              infile_name);
+    return BUFFER_TOO_SMALL;
+  }
   return (success == 0);
 }
 
+int decompress_file_bounded(const char *infile_name,
+                            unsigned char *output_string,
+                            size_t output_capacity, size_t *output_length) {
+  return decompress_file_io(infile_name, output_string, output_capacity,
+                            output_length, BLOCK_SIZE, ASYNC_IO_DEPTH, NULL);
+}
+
+/*
+ * decompress_buffer without the logging, BUFFER_TOO_SMALL may be expected.
+ * Times are added to stats.
+ */
+static int inflate_buffer(unsigned char *input_string, size_t input_length,
+                          unsigned char *output_string, size_t output_capacity,
+                          size_t *output_length, int thread_num,
+                          igzip_stats *stats) {
+  size_t total_inflated = 0;
+  uint64_t start;
+  int ret;
+
+  *output_length = 0;
+#if defined(HAVE_THREADS)
+  if (thread_num > 1 &&
+      inflate_members_parallel(input_string, input_length, output_string,
+                               output_capacity, &total_inflated, thread_num,
+                               stats) == 0) {
+    *output_length = total_inflated;
+    return 0;
+  }
+#endif
+
+  total_inflated = 0;
+  start = igzip_clock_ns();
+  ret = inflate_members_mem(input_string, input_length, output_string,
+                            output_capacity, &total_inflated,
+                            &stats->inflate_ns);
+  // the serial pass runs on the caller, after any parallel workers
+  igzip_stats_busy(stats, stats->worker_count > 0 ? stats->worker_count - 1 : 0,
+                   igzip_clock_ns() - start);
+  *output_length = total_inflated;
+  if (ret == ISAL_OUT_OVERFLOW)
+    return BUFFER_TOO_SMALL;
+  return ret != ISAL_DECOMP_OK;
+}
+
+// End the accounting of a decompress call
+static void decompress_stats_end(igzip_stats *stats, size_t input_length,
+                                 size_t output_length, uint64_t begin,
+                                 igzip_stats *out_stats) {
+  stats->bytes_in = input_length;
+  stats->bytes_out = output_length;
+  stats->total_ns = igzip_clock_ns() - begin;
+  igzip_stats_commit(stats, 1, out_stats);
+}
+
+static int decompress_buffer_stats(unsigned char *input_string,
+                                   size_t input_length,
+                                   unsigned char *output_string,
+                                   size_t output_capacity,
+                                   size_t *output_length, int thread_num,
+                                   igzip_stats *stats) {
+  int ret;
+
+  *output_length = 0;
+  if (input_string == NULL || output_string == NULL)
+    return 1;
+
+  ret = inflate_buffer(input_string, input_length, output_string,
+                       output_capacity, output_length, thread_num, stats);
+  if (ret == BUFFER_TOO_SMALL)
+    log_print(ERROR, "igzip: Output buffer too small for inflated data\n");
+  else if (ret != 0)
+    log_print(ERROR, "igzip: Error encountered while decompressing buffer\n");
+  return ret;
+}
+
+int decompress_buffer(unsigned char *input_string, size_t input_length,
+                      unsigned char *output_string, size_t output_capacity,
+                      size_t *output_length, int thread_num) {
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns();
+  int ret = decompress_buffer_stats(input_string, input_length, output_string,
+                                    output_capacity, output_length, thread_num,
+                                    &stats);
+  decompress_stats_end(&stats, input_length, *output_length, begin, NULL);
+  return ret;
+}
+
+/*
+ * Uncompressed size of a gzip buffer, summed over the ISIZE trailers of the
+ * members scan_members finds. Nothing is inflated, so the flags say how far
+ * to trust it.
+ */
+static size_t gzip_buffer_size(unsigned char *in, size_t in_length,
+                               int *size_flags) {
+  struct gzip_member *members;
+  size_t i, count, total = 0;
+
+  *size_flags = 0;
+  count = scan_members(in, in_length, &members);
+  for (i = 0; i < count; i++) {
+    total += members[i].out_length;
+    if ((uint64_t)members[i].in_length * MAX_DEFLATE_RATIO >=
+        (uint64_t)members[i].out_length + ((uint64_t)1 << 32))
+      *size_flags |= GZIP_SIZE_WRAPPED;
+    if (i + 1 < count && bgzf_block_length(in + members[i].in_offset,
+                                           members[i].in_length) == 0)
+      *size_flags |= GZIP_SIZE_GUESSED;
+  }
+  igzip_free(members);
+  return total;
+}
+
+int gzip_file_size(const char *infile_name, size_t *output_length,
+                   int *size_flags) {
+  FILE *in = NULL;
+  unsigned char *inbuf;
+  size_t inbuf_size = 0;
+  bool mapped = false;
+
+  *output_length = 0;
+  *size_flags = 0;
+  open_in_file(&in, infile_name);
+  if (in == NULL)
+    return 1;
+
+  inbuf = load_in_file(in, infile_name, &inbuf_size, &mapped);
+  *output_length = gzip_buffer_size(inbuf, inbuf_size, size_flags);
+
+  if (in != stdin)
+    fclose(in);
+  release_in_file(inbuf, inbuf_size, mapped);
+  return 0;
+}
+
+int decompress_file_alloc(const char *infile_name,
+                          unsigned char **output_string,
+                          size_t *output_length, int thread_num) {
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns(), start;
+  FILE *in = NULL;
+  unsigned char *inbuf, *outbuf;
+  size_t inbuf_size = 0, capacity;
+  bool mapped = false;
+  int size_flags, ret;
+
+  *output_string = NULL;
+  *output_length = 0;
+  open_in_file(&in, infile_name);
+  if (in == NULL)
+    return 1;
+
+  // The input is read once and serves both the size query and the inflate
+  start = igzip_clock_ns();
+  inbuf = load_in_file(in, infile_name, &inbuf_size, &mapped);
+  stats.read_ns = igzip_clock_ns() - start;
+  capacity = gzip_buffer_size(inbuf, inbuf_size, &size_flags);
+  if (capacity == 0)
+    capacity = 1;
+  outbuf = (unsigned char *)malloc_safe(capacity);
+  ret = 1;
+#if defined(HAVE_THREADS)
+  if (thread_num > 1)
+    ret = inflate_members_parallel(inbuf, inbuf_size, outbuf, capacity,
+                                   output_length, thread_num, &stats);
+#endif
+  if (ret != 0) {
+    // A wrapped ISIZE or an unframed member may undercount, so the serial
+    // pass grows the output in place rather than starting over
+    *output_length = 0;
+    start = igzip_clock_ns();
+    ret = inflate_members_grow(inbuf, inbuf_size, &outbuf, &capacity,
+                               output_length, &stats.inflate_ns);
+    igzip_stats_busy(&stats,
+                     stats.worker_count > 0 ? stats.worker_count - 1 : 0,
+                     igzip_clock_ns() - start);
+    ret = ret != ISAL_DECOMP_OK;
+  }
+
+  if (in != stdin)
+    fclose(in);
+  release_in_file(inbuf, inbuf_size, mapped);
+  decompress_stats_end(&stats, inbuf_size, *output_length, begin, NULL);
+
+  if (ret != 0) {
+    log_print(ERROR, "igzip: Error encountered while decompressing file %s\n",
+              infile_name);
+    igzip_free(outbuf);
+    *output_length = 0;
+    return ret;
+  }
+  // A false boundary or a growth step overcounts, give back the rest
+  if (*output_length < capacity && *output_length > 0)
+    outbuf = (unsigned char *)realloc_safe(outbuf, capacity, *output_length);
+  *output_string = outbuf;
+  return 0;
+}
+
+static int decompress_file_mt_stats(const char *infile_name,
+                                    unsigned char *output_string,
+                                    size_t output_capacity,
+                                    size_t *output_length, int thread_num,
+                                    igzip_stats *out_stats) {
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns(), start;
+  FILE *in = NULL;
+  unsigned char *inbuf = NULL;
+  size_t inbuf_size = 0;
+  bool mapped = false;
+  int ret = 1;
+
+  *output_length = 0;
+  open_in_file(&in, infile_name);
+  if (in == NULL)
+    return 1;
+
+  if (output_string == NULL) {
+    log_print(ERROR, "igzip: Inflated string buffer for file %s is null\n",
+              infile_name);
+    goto decompress_file_mt_cleanup;
+  }
+
+  // Members are decoded out of order, so the whole input is kept in memory
+  start = igzip_clock_ns();
+  inbuf = load_in_file(in, infile_name, &inbuf_size, &mapped);
+  stats.read_ns = igzip_clock_ns() - start;
+  ret = decompress_buffer_stats(inbuf, inbuf_size, output_string,
+                                output_capacity, output_length, thread_num,
+                                &stats);
+  decompress_stats_end(&stats, inbuf_size, *output_length, begin, out_stats);
+
+decompress_file_mt_cleanup:
+
+  if (in != stdin) {
+    fclose(in);
+  }
+  if (inbuf != NULL)
+    release_in_file(inbuf, inbuf_size, mapped);
+  return ret;
+}
+
+int decompress_file_mt(const char *infile_name, unsigned char *output_string,
+                       size_t output_capacity, size_t *output_length,
+                       int thread_num) {
+  return decompress_file_mt_stats(infile_name, output_string, output_capacity,
+                                  output_length, thread_num, NULL);
+}
+
+/*
+ * Compressed input of a streaming inflate: a mapping of the whole file when
+ * it is a regular file, otherwise buffers read ahead by an async_io helper.
+ */
+struct inflate_input {
+  unsigned char *map;
+  size_t map_length;
+  size_t map_pos;
+  size_t map_dropped; // pages before it are handed back
+  async_io *reader;
+  unsigned char *carry; // joins a split member magic to the next buffer
+};
+
+static int input_eof(struct inflate_input *src) {
+  return src->map != NULL ? src->map_pos == src->map_length
+                          : async_eof(src->reader);
+}
+
+// Next run of input after state->next_in. Keeps any bytes still unused.
+static void input_refill(struct inflate_input *src,
+                         struct inflate_state *state) {
+  if (src->map != NULL) {
+    // the mapping is contiguous, so unused bytes already sit in front. One
+    // window at a time keeps the resident part of it bounded
+    size_t left = src->map_length - src->map_pos;
+    size_t room = MMAP_WINDOW - state->avail_in;
+    size_t n = left < room ? left : room;
+    mmap_slide(src->map, src->map_length, &src->map_dropped,
+               src->map_pos - state->avail_in);
+    state->next_in = src->map + src->map_pos - state->avail_in;
+    state->avail_in += n;
+    src->map_pos += n;
+  } else if (state->avail_in == 0) {
+    size_t length;
+    state->next_in = async_read(src->reader, &length);
+    state->avail_in = length;
+  } else {
+    // Rare: a byte left at a member end, copy both into one run
+    size_t length, kept = state->avail_in;
+    memmove(src->carry, state->next_in, kept);
+    unsigned char *next = async_read(src->reader, &length);
+    memcpy(src->carry + kept, next, length);
+    state->next_in = src->carry;
+    state->avail_in = kept + length;
+  }
+}
+
+// Hand a chunk to the caller's sink, its time counts as writing
+static int sink_chunk(decompress_sink sink, void *opaque,
+                      const unsigned char *data, size_t length,
+                      igzip_stats *stats) {
+  uint64_t start = igzip_clock_ns();
+  int ret = sink(opaque, data, length);
+  stats->write_ns += igzip_clock_ns() - start;
+  return ret;
+}
+
+int decompress_file_stream(const char *infile_name, size_t chunk_size,
+                           decompress_sink sink, void *opaque,
+                           size_t *output_length) {
+  igzip_stats stats = {0};
+  uint64_t begin = igzip_clock_ns(), start;
+  FILE *in = NULL;
+  unsigned char *outbuf = NULL;
+  struct inflate_state *state;
+  struct inflate_input src = {0};
+  size_t total_inflated = 0;
+  int ret = ISAL_DECOMP_OK, success = 0, full;
+
+  *output_length = 0;
+  if (sink == NULL)
+    return 1;
+  if (chunk_size == 0 || chunk_size > MAX_INFLATE_CHUNK)
+    chunk_size = chunk_size == 0 ? BLOCK_SIZE : MAX_INFLATE_CHUNK;
+
+  open_in_file(&in, infile_name);
+  if (in == NULL)
+    return 1;
+
+  // Memory stays at the state, its window and the I/O buffers. A mapping
+  // costs address space, plus the window input_refill keeps resident
+  src.map = mmap_in_file(in, infile_name, &src.map_length);
+  if (src.map == NULL) {
+    src.reader = async_reader_open(in, infile_name, BLOCK_SIZE, ASYNC_IO_DEPTH);
+    async_io_set_stats(src.reader, &stats);
+    src.carry = (unsigned char *)cache_alloc(BLOCK_SIZE + 2);
+  }
+  outbuf = (unsigned char *)cache_alloc(chunk_size);
+  state = (struct inflate_state *)cache_alloc(sizeof(struct inflate_state));
+
+  isal_inflate_init(state);
+  state->crc_flag = ISAL_GZIP; // Let isal_inflate() process the header
+  state->next_in = src.map;
+  state->avail_in = 0;
+  state->next_out = outbuf;
+  state->avail_out = chunk_size;
+
+  for (;;) {
+    do {
+      if (state->avail_in == 0 && !input_eof(&src))
+        input_refill(&src, state);
+
+      start = igzip_clock_ns();
+      TRACE_BEGIN(TRACE_INFLATE, state->avail_in);
+      ret = isal_inflate(state);
+      TRACE_END(TRACE_INFLATE);
+      stats.inflate_ns += igzip_clock_ns() - start;
+      if (ret != ISAL_DECOMP_OK) {
+        log_print(ERROR,
+                  "igzip: Error encountered while decompressing file %s\n",
+                  infile_name);
+        goto decompress_file_stream_cleanup;
+      }
+
+      // Hand over whole chunks as soon as they fill up
+      full = state->avail_out == 0;
+      if (full) {
+        total_inflated += chunk_size;
+        if (sink_chunk(sink, opaque, outbuf, chunk_size, &stats) != 0)
+          goto decompress_file_stream_cleanup;
+        state->next_out = outbuf;
+        state->avail_out = chunk_size;
+      }
+    } while (state->block_state != ISAL_BLOCK_FINISH &&
+             (!input_eof(&src) || state->avail_in > 0 || full));
+
+    if (state->block_state != ISAL_BLOCK_FINISH) {
+      log_print(ERROR,
+                "igzip: Error %s does not contain a complete gzip file\n",
+                infile_name);
+      goto decompress_file_stream_cleanup;
+    }
+
+    // Look for magic numbers of a concatenated member. Follows the gzread()
+    // decision whether to treat as trailing junk
+    if (state->avail_in < 2 && !input_eof(&src))
+      input_refill(&src, state);
+    if (state->avail_in < 2 || state->next_in[0] != 31 ||
+        state->next_in[1] != 139)
+      break;
+
+    isal_inflate_reset(state);
+    state->crc_flag = ISAL_GZIP;
+  }
+
+  // The partial last chunk
+  if (state->next_out > outbuf) {
+    total_inflated += state->next_out - outbuf;
+    if (sink_chunk(sink, opaque, outbuf, state->next_out - outbuf, &stats) !=
+        0)
+      goto decompress_file_stream_cleanup;
+  }
+  success = 1;
+
+decompress_file_stream_cleanup:
+
+  async_io_close(src.reader);
+  if (in != stdin)
+    fclose(in);
+  if (src.map != NULL)
+    release_in_file(src.map, src.map_length, true);
+  if (src.carry != NULL)
+    cache_free(src.carry, BLOCK_SIZE + 2);
+  cache_free(outbuf, chunk_size);
+  cache_free(state, sizeof(struct inflate_state));
+
+  *output_length = total_inflated;
+  igzip_stats_busy(&stats, 0, stats.inflate_ns);
+  // a reader has added the bytes it handed out on close
+  decompress_stats_end(&stats, src.map != NULL ? src.map_pos : stats.bytes_in,
+                       total_inflated, begin, NULL);
+  return (success == 0);
+}
+
+int decompress_file_opts(const char *infile_name, unsigned char *output_string,
+                         size_t output_capacity, size_t *output_length,
+                         const igzip_options *options) {
+  igzip_options opts = *options;
+
+  igzip_options_tune(&opts, SIZE_MAX);
+  if (opts.thread_num > 1)
+    return decompress_file_mt_stats(infile_name, output_string,
+                                    output_capacity, output_length,
+                                    opts.thread_num, opts.stats);
+  return decompress_file_io(infile_name, output_string, output_capacity,
+                            output_length, opts.io_buffer_size, opts.io_depth,
+                            opts.stats);
+}
+
+int decompress_file(const char *infile_name, unsigned char *output_string,
+                    size_t *output_length) {
+  // Unbounded legacy entry: the caller vouches the buffer is large enough
+  return decompress_file_bounded(infile_name, output_string, SIZE_MAX,
+                                 output_length);
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,301 @@
+#include "igzip_wrapper.h"
+#include <errno.h>
+
+#if defined(HAVE_THREADS)
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Double buffered file I/O. A helper thread runs through a ring of depth
+ * buffers in order, reading ahead into them or writing them behind, while
+ * the caller (de)compresses the buffer it holds. Two semaphores hand slots
+ * back and forth: ready counts slots the helper may take, done counts slots
+ * the caller may take. Without threads every call is a plain blocking read
+ * or write on a single buffer.
+ */
+struct io_slot {
+  unsigned char *buf;
+  size_t length;
+};
+
+struct _async_io {
+  FILE *file;    // reader input
+  out_fd *out;   // writer output
+  const char *name;
+  int writing;
+  int depth;
+  size_t buf_size;
+  struct io_slot *slots;
+  uint64_t head; // next slot of the helper
+  uint64_t tail; // next slot of the caller
+  int holding;   // caller has slot tail - 1 (reader) or tail (writer)
+  int eof;
+  uint64_t bytes;   // handed to the reader's caller
+  uint64_t reads;   // read calls, made by the helper when there is one
+  uint64_t wait_ns; // caller blocked on a buffer
+  igzip_stats *stats;
+#if defined(HAVE_THREADS)
+  pthread_t thread;
+  sem_t ready;
+  sem_t done;
+  _Atomic int finished; // reader helper saw the end of input
+  _Atomic int stop;
+#endif
+};
+
+// Fill buf from fd unless the input ends first, like fread on a pipe
+static size_t read_full(int fd, unsigned char *buf, size_t size,
+                        const char *name, uint64_t *reads) {
+  size_t got = 0;
+  TRACE_BEGIN(TRACE_READ, size);
+  while (got < size) {
+    ssize_t n = read(fd, buf + got, size - got);
+    (*reads)++;
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_print(ERROR, "igzip: Error encountered while reading file %s\n",
+                name);
+      exit(FILE_READ_ERROR);
+    }
+    got += n;
+  }
+  TRACE_END(TRACE_READ);
+  return got;
+}
+
+#if defined(HAVE_THREADS)
+static void *io_reader(void *arg) {
+  async_io *io = (async_io *)arg;
+
+  TRACE_NAME("reader");
+  for (;;) {
+    while (sem_wait(&io->ready) != 0)
+      ;
+    if (atomic_load(&io->stop))
+      break;
+    struct io_slot *slot = &io->slots[io->head % io->depth];
+    slot->length = read_full(fileno(io->file), slot->buf, io->buf_size,
+                             io->name, &io->reads);
+    io->head++;
+    if (slot->length == 0)
+      atomic_store(&io->finished, 1);
+    sem_post(&io->done);
+    if (slot->length == 0)
+      break; // an empty slot marks the end of input
+  }
+  return NULL;
+}
+
+static void *io_writer(void *arg) {
+  async_io *io = (async_io *)arg;
+
+  TRACE_NAME("write behind");
+  for (;;) {
+    while (sem_wait(&io->ready) != 0)
+      ;
+    if (atomic_load(&io->stop))
+      break;
+    struct io_slot *slot = &io->slots[io->head % io->depth];
+    struct iovec iov = {slot->buf, slot->length};
+    out_fd_writev(io->out, &iov, 1);
+    io->head++;
+    sem_post(&io->done);
+  }
+  return NULL;
+}
+#endif
+
+static async_io *async_io_open(FILE *file, out_fd *out, const char *name,
+                               size_t buf_size, int depth, int writing) {
+  async_io *io = (async_io *)malloc_safe(sizeof(async_io));
+  int i;
+
+#if !defined(HAVE_THREADS)
+  depth = 1;
+#endif
+  if (depth < 2)
+    depth = 1;
+
+  io->file = file;
+  io->out = out;
+  io->name = name;
+  io->writing = writing;
+  io->depth = depth;
+  io->buf_size = buf_size;
+  io->head = 0;
+  io->tail = 0;
+  io->holding = 0;
+  io->eof = 0;
+  io->bytes = 0;
+  io->reads = 0;
+  io->wait_ns = 0;
+  io->stats = NULL;
+  io->slots = (struct io_slot *)malloc_safe(depth * sizeof(struct io_slot));
+  for (i = 0; i < depth; i++) {
+    // aligned so that full buffers qualify for O_DIRECT
+    io->slots[i].buf =
+        (unsigned char *)cache_alloc(buf_size);
+    io->slots[i].length = 0;
+  }
+
+#if defined(HAVE_THREADS)
+  if (depth > 1) {
+    // Readers start with every slot free to fill, writers with every slot
+    // free for the caller
+    sem_init(&io->ready, 0, writing ? 0 : depth);
+    sem_init(&io->done, 0, writing ? depth : 0);
+    atomic_init(&io->finished, 0);
+    atomic_init(&io->stop, 0);
+    pthread_create(&io->thread, NULL, writing ? io_writer : io_reader,
+                   (void *)io);
+  }
+#endif
+  return io;
+}
+
+async_io *async_reader_open(FILE *in, const char *infile_name,
+                            size_t buf_size, int depth) {
+  return async_io_open(in, NULL, infile_name, buf_size, depth, 0);
+}
+
+async_io *async_writer_open(out_fd *out, size_t buf_size, int depth) {
+  return async_io_open(NULL, out, out->name, buf_size, depth, 1);
+}
+
+int async_eof(async_io *io) { return io->eof; }
+
+unsigned char *async_read(async_io *io, size_t *length) {
+  struct io_slot *slot;
+  uint64_t start;
+
+  *length = 0;
+  if (io->eof)
+    return NULL;
+
+  start = igzip_clock_ns();
+  TRACE_BEGIN(TRACE_REFILL, io->bytes);
+  if (io->depth == 1) {
+    slot = &io->slots[0];
+    slot->length = read_full(fileno(io->file), slot->buf, io->buf_size,
+                             io->name, &io->reads);
+  } else {
+#if defined(HAVE_THREADS)
+    // Recycle the buffer given out last time, then take the next one
+    if (io->holding)
+      sem_post(&io->ready);
+    while (sem_wait(&io->done) != 0)
+      ;
+    slot = &io->slots[io->tail % io->depth];
+    io->tail++;
+    io->holding = 1;
+#endif
+  }
+  TRACE_END(TRACE_REFILL);
+  io->wait_ns += igzip_clock_ns() - start;
+
+  if (slot->length == 0)
+    io->eof = 1;
+  io->bytes += slot->length;
+  *length = slot->length;
+  return slot->buf;
+}
+
+unsigned char *async_write_buffer(async_io *io) {
+  if (!io->holding && io->depth > 1) {
+#if defined(HAVE_THREADS)
+    uint64_t start = igzip_clock_ns();
+    while (sem_wait(&io->done) != 0)
+      ;
+    io->wait_ns += igzip_clock_ns() - start;
+#endif
+  }
+  io->holding = 1;
+  return io->slots[io->tail % io->depth].buf;
+}
+
+void async_write(async_io *io, size_t length) {
+  struct io_slot *slot = &io->slots[io->tail % io->depth];
+
+  slot->length = length;
+  io->holding = 0;
+  if (io->depth == 1) {
+    struct iovec iov = {slot->buf, length};
+    out_fd_writev(io->out, &iov, 1);
+    return;
+  }
+#if defined(HAVE_THREADS)
+  io->tail++;
+  sem_post(&io->ready);
+#endif
+}
+
+void async_flush(async_io *io) {
+  if (!io->writing || io->depth == 1)
+    return;
+#if defined(HAVE_THREADS)
+  // Every slot the caller doesn't hold comes back once it has been written
+  int i, queued = io->depth - io->holding;
+  uint64_t start = igzip_clock_ns();
+  for (i = 0; i < queued; i++)
+    while (sem_wait(&io->done) != 0)
+      ;
+  for (i = 0; i < queued; i++)
+    sem_post(&io->done);
+  io->wait_ns += igzip_clock_ns() - start;
+#endif
+}
+
+void async_io_set_stats(async_io *io, igzip_stats *stats) {
+  if (io != NULL)
+    io->stats = stats;
+}
+
+void async_io_close(async_io *io) {
+  int i;
+  if (io == NULL)
+    return;
+
+#if defined(HAVE_THREADS)
+  if (io->depth > 1) {
+    if (io->writing) {
+      async_flush(io);
+      atomic_store(&io->stop, 1);
+      sem_post(&io->ready);
+    } else if (!atomic_load(&io->finished)) {
+      // The caller stopped early, the helper may sit in read() on a pipe
+      atomic_store(&io->stop, 1);
+      pthread_cancel(io->thread);
+    }
+    pthread_join(io->thread, NULL);
+    sem_destroy(&io->ready);
+    sem_destroy(&io->done);
+  }
+#endif
+  // The helper is gone, its counters are settled
+  if (io->stats != NULL) {
+    if (io->writing) {
+      io->stats->stall_ns += io->wait_ns;
+    } else {
+      io->stats->bytes_in += io->bytes;
+      io->stats->read_calls += io->reads;
+      io->stats->read_ns += io->wait_ns;
+    }
+  }
+  for (i = 0; i < io->depth; i++)
+    cache_free(io->slots[i].buf, io->buf_size);
+  igzip_free(io->slots);
+  igzip_free(io);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
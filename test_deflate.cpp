@@ -1,13 +1,23 @@
 #include "igzip_wrapper.h"
+#include <atomic>
 #include <chrono>
 #include <cstring>
+#include <fcntl.h>
 #include <functional>
 #include <iostream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #define READ_BUF_ONCE 1024 * 1024
 #define BUFFER_SIZE 1ll << 31 // maximum 2GiB to store intermediate buffer
 
+#ifdef HAVE_THREADS
+#define THREAD_NUM 8
+#else
+#define THREAD_NUM 1
+#endif
+
 void load(FILE *fp, unsigned char *dst, size_t *length) {
   size_t read;
   for (*length = 0; *length < BUFFER_SIZE; *length += read) {
@@ -20,7 +30,30 @@ void load(FILE *fp, unsigned char *dst, size_t *length) {
   }
 }
 
+// Counts what the library allocates through the hook
+std::atomic<size_t> hook_allocs(0);
+std::atomic<size_t> hook_releases(0);
+
+void *countingAlloc(void *opaque, size_t size, size_t alignment) {
+  void *ptr = NULL;
+  hook_allocs++;
+  if (posix_memalign(&ptr, alignment < sizeof(void *) ? sizeof(void *)
+                                                      : alignment,
+                     size) != 0)
+    return NULL;
+  return ptr;
+}
+
+void countingRelease(void *opaque, void *ptr) {
+  if (ptr != NULL)
+    hook_releases++;
+  free(ptr);
+}
+
 int main(int argc, char *argv[]) {
+  igzip_allocator allocator = {countingAlloc, countingRelease, NULL};
+  igzip_set_allocator(&allocator);
+
   unsigned char *src = (unsigned char *)malloc(BUFFER_SIZE);
   if (src == NULL) {
     log_print(ERROR, "Cannot malloc check buffer\n");
@@ -34,21 +67,44 @@ int main(int argc, char *argv[]) {
   }
 
   size_t src_len = 0, decompress_len = 0;
+  int ret;
 
   load(src_fp, src, &src_len);
 
   std::chrono::steady_clock::time_point begin =
       std::chrono::steady_clock::now();
 
-#ifdef HAVE_THREADS
-  // max compress level is 3, max thread nums is 8
-  compress_file(src, src_len, argv[2], 3, 8);
-#else
-  compress_file(src, src_len, argv[2], 3, 1);
-#endif
+  // max compress level is 3
+  compress_file(src, src_len, argv[2], 3, THREAD_NUM);
 
   std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
 
+  // Another call from this thread reuses the cached context and buffers
+  size_t first_allocs = hook_allocs.load();
+  assert(first_allocs > 0);
+  unlink(argv[2]);
+  compress_file(src, src_len, argv[2], 3, THREAD_NUM);
+  assert(hook_allocs.load() - first_allocs < first_allocs);
+  // Released on request rather than only when the thread exits
+  size_t releases = hook_releases.load();
+  compress_cache_release();
+  assert(hook_releases.load() > releases);
+
+  // compress_buffer shares the cache, a second payload sets nothing up
+  size_t payload_len = src_len < 65536 ? src_len : 65536, payload_out = 0;
+  std::vector<unsigned char> payload(compress_bound(payload_len));
+  size_t before_allocs = hook_allocs.load();
+  ret = compress_buffer(src, payload_len, payload.data(), payload.size(),
+                        &payload_out, 1, THREAD_NUM);
+  assert(ret == 0);
+  size_t setup_allocs = hook_allocs.load() - before_allocs;
+  before_allocs = hook_allocs.load();
+  ret = compress_buffer(src, payload_len, payload.data(), payload.size(),
+                        &payload_out, 1, THREAD_NUM);
+  assert(ret == 0);
+  assert(hook_allocs.load() - before_allocs < setup_allocs);
+  compress_cache_release();
+
   std::cout
       << "Compression elapse = "
       << std::chrono::duration_cast<std::chrono::seconds>(end - begin).count()
@@ -65,6 +121,373 @@ int main(int argc, char *argv[]) {
   assert(src_len == decompress_len);
   assert(memcmp(src, decompress, src_len) == 0);
 
+  // A reused context must round trip on every call, in every output mode
+  int modes[] = {0, COMPRESS_DICT_CHAIN, COMPRESS_BGZF, COMPRESS_ADAPTIVE,
+                 COMPRESS_BGZF | COMPRESS_ADAPTIVE};
+  compress_ctx *ctx = compress_ctx_create(3, THREAD_NUM);
+  assert(ctx != NULL);
+  for (int mode : modes) {
+    ret = compress_ctx_set_flags(ctx, mode);
+    assert(ret == 0);
+    unlink(argv[2]);
+    ret = compress_file_ctx(ctx, src, src_len, argv[2]);
+    assert(ret == 0);
+    decompress_len = 0;
+    decompress_file(argv[2], decompress, &decompress_len);
+    assert(src_len == decompress_len);
+    assert(memcmp(src, decompress, src_len) == 0);
+    // One member sized by its last trailer or BGZF blocks summed, header
+    // patterns inside the deflate stream must not be counted as members
+    size_t queried = 0;
+    int size_flags = 0;
+    ret = gzip_file_size(argv[2], &queried, &size_flags);
+    assert(ret == 0);
+    if (mode & COMPRESS_BGZF)
+      assert(queried == src_len && size_flags == 0);
+    else
+      assert(queried == (src_len & 0xffffffffu));
+    if (mode == COMPRESS_BGZF) {
+      // BGZF blocks are independent members, found without speculation
+      decompress_len = 0;
+      ret = decompress_file_mt(argv[2], decompress, src_len, &decompress_len,
+                               THREAD_NUM);
+      assert(ret == 0);
+      assert(src_len == decompress_len);
+      assert(memcmp(src, decompress, src_len) == 0);
+    }
+  }
+
+  // Ranges read through an index, recorded while compressing and reloaded
+  // from its sidecar, match the source in every output mode
+  std::string index_name = std::string(argv[2]) + ".idx";
+  gzip_index *index = gzip_index_create(BLOCK_SIZE);
+  ret = compress_ctx_set_index(ctx, index);
+  assert(ret == 0);
+  for (int mode : modes) {
+    ret = compress_ctx_set_flags(ctx, mode);
+    assert(ret == 0);
+    unlink(argv[2]);
+    unlink(index_name.c_str());
+    ret = compress_file_ctx(ctx, src, src_len, argv[2]);
+    assert(ret == 0);
+    ret = gzip_index_save(index, index_name.c_str());
+    assert(ret == 0);
+    gzip_index *loaded = gzip_index_load(index_name.c_str());
+    assert(loaded != NULL);
+    size_t ranges[][2] = {{0, 100},
+                          {src_len / 3, 4096},
+                          {src_len / 2, 3 * BLOCK_SIZE / 2},
+                          {src_len > 10 ? src_len - 10 : 0, 100}};
+    for (auto &range : ranges) {
+      size_t offset = range[0] < src_len ? range[0] : 0;
+      size_t expect = src_len - offset < range[1] ? src_len - offset : range[1];
+      ret = gzip_index_read(loaded, argv[2], offset, decompress, range[1],
+                            &decompress_len);
+      assert(ret == 0);
+      assert(decompress_len == expect);
+      assert(memcmp(src + offset, decompress, expect) == 0);
+    }
+    gzip_index_free(loaded);
+  }
+  compress_ctx_set_index(ctx, NULL);
+
+  // The single thread path flushes on each checkpoint, whose offset has to
+  // be the byte count handed to the file so far (isal's total_out wraps)
+  compress_ctx *serial = compress_ctx_create(3, 1);
+  assert(serial != NULL);
+  compress_ctx_set_index(serial, index);
+  unlink(argv[2]);
+  ret = compress_file_ctx(serial, src, src_len, argv[2]);
+  assert(ret == 0);
+  for (size_t offset = 0; offset < src_len; offset += BLOCK_SIZE + 4095) {
+    size_t expect = src_len - offset < 8192 ? src_len - offset : 8192;
+    ret = gzip_index_read(index, argv[2], offset, decompress, 8192,
+                          &decompress_len);
+    assert(ret == 0);
+    assert(decompress_len == expect);
+    assert(memcmp(src + offset, decompress, expect) == 0);
+  }
+  compress_ctx_destroy(serial);
+
+  // Memory to memory in every mode, sized by the bound in one allocation
+  size_t bound = compress_bound(src_len);
+  unsigned char *packed = (unsigned char *)malloc(bound);
+  assert(packed != NULL);
+  for (int mode : modes) {
+    size_t packed_len = 0;
+    ret = compress_ctx_set_flags(ctx, mode);
+    assert(ret == 0);
+    ret = compress_buffer_ctx(ctx, src, src_len, packed, bound, &packed_len);
+    assert(ret == 0);
+    assert(packed_len <= bound);
+    ret = decompress_buffer(packed, packed_len, decompress, src_len,
+                            &decompress_len, THREAD_NUM);
+    assert(ret == 0);
+    assert(src_len == decompress_len);
+    assert(memcmp(src, decompress, src_len) == 0);
+    if (packed_len > 0) {
+      // a buffer one byte short must be refused rather than overrun
+      ret = compress_buffer_ctx(ctx, src, src_len, packed, packed_len - 1,
+                                &decompress_len);
+      assert(ret == BUFFER_TOO_SMALL);
+    }
+  }
+  free(packed);
+
+  // Concatenated plain members, the first larger than the last: the size is
+  // summed over every trailer and the output allocated once to fit it
+  size_t split = src_len - src_len / 4, first_len = 0, last_len = 0;
+  std::vector<unsigned char> concat(compress_bound(split) +
+                                    compress_bound(src_len - split));
+  ret = compress_ctx_set_flags(ctx, 0);
+  assert(ret == 0);
+  ret = compress_buffer_ctx(ctx, src, split, concat.data(), concat.size(),
+                            &first_len);
+  assert(ret == 0);
+  ret = compress_buffer_ctx(ctx, src + split, src_len - split,
+                            concat.data() + first_len,
+                            concat.size() - first_len, &last_len);
+  assert(ret == 0);
+  FILE *concat_fp = fopen(argv[2], "wb");
+  assert(concat_fp != NULL);
+  size_t written = fwrite(concat.data(), 1, first_len + last_len, concat_fp);
+  assert(written == first_len + last_len);
+  fclose(concat_fp);
+  size_t concat_size = 0;
+  int concat_flags = 0;
+  ret = gzip_file_size(argv[2], &concat_size, &concat_flags);
+  assert(ret == 0);
+  assert(concat_size == src_len);
+  for (int threads : {1, THREAD_NUM}) {
+    unsigned char *allocated = NULL;
+    size_t allocated_len = 0;
+    ret = decompress_file_alloc(argv[2], &allocated, &allocated_len, threads);
+    assert(ret == 0);
+    assert(allocated_len == src_len);
+    assert(memcmp(src, allocated, src_len) == 0);
+    igzip_free(allocated);
+  }
+
+  // Incompressible blocks are stored, so gzip headers planted in the data
+  // show up in the stream, after an ISIZE no member that short could have;
+  // they must neither split nor size the member
+  std::vector<unsigned char> noise(4 * BLOCK_SIZE);
+  uint32_t seed = 1;
+  for (auto &byte : noise) {
+    seed = seed * 1103515245 + 12345;
+    byte = seed >> 24;
+  }
+  const unsigned char fake_header[] = {255, 255, 255, 255, 31, 139, 8,
+                                       0,   0,   0,   0,   0,  0, 255};
+  for (size_t pos = 1000; pos + sizeof(fake_header) < noise.size();
+       pos += BLOCK_SIZE / 2)
+    memcpy(&noise[pos], fake_header, sizeof(fake_header));
+  ret = compress_ctx_set_flags(ctx, COMPRESS_ADAPTIVE);
+  assert(ret == 0);
+  unlink(argv[2]);
+  ret = compress_file_ctx(ctx, noise.data(), noise.size(), argv[2]);
+  assert(ret == 0);
+  size_t noise_size = 0;
+  int noise_flags = 0;
+  ret = gzip_file_size(argv[2], &noise_size, &noise_flags);
+  assert(ret == 0);
+  assert(noise_size == noise.size());
+  decompress_len = 0;
+  ret = decompress_file_mt(argv[2], decompress, noise.size(), &decompress_len,
+                           THREAD_NUM);
+  assert(ret == 0);
+  assert(decompress_len == noise.size());
+  assert(memcmp(noise.data(), decompress, decompress_len) == 0);
+
+  // Many small records at once, each an independent member of its own
+  std::vector<compress_record> records;
+  size_t record_pos = 0, record_len = 2048;
+  while (record_pos < src_len && records.size() < 2000) {
+    size_t n = src_len - record_pos < record_len ? src_len - record_pos
+                                                 : record_len;
+    size_t cap = compress_bound(n);
+    compress_record record = {src + record_pos, n, (unsigned char *)malloc(cap),
+                              cap, 0, -1};
+    records.push_back(record);
+    record_pos += n;
+    record_len = record_len * 3 % (64 * 1024) + 2048; // 2 to 64 KiB
+  }
+  std::vector<size_t> member_lengths;
+  ret = compress_ctx_set_flags(ctx, 0);
+  assert(ret == 0);
+  ret = compress_batch_ctx(ctx, records.data(), records.size());
+  assert(ret == 0);
+  for (auto &record : records) {
+    assert(record.status == 0);
+    ret = decompress_buffer(record.output, record.output_length, decompress,
+                            record.input_length, &decompress_len, 1);
+    assert(ret == 0);
+    assert(decompress_len == record.input_length);
+    assert(memcmp(record.input, decompress, decompress_len) == 0);
+    member_lengths.push_back(record.output_length);
+  }
+  // the same deflate data without the 10 byte header and 8 byte trailer
+  ret = compress_ctx_set_flags(ctx, COMPRESS_RAW);
+  assert(ret == 0);
+  ret = compress_batch_ctx(ctx, records.data(), records.size());
+  assert(ret == 0);
+  for (size_t i = 0; i < records.size(); i++)
+    assert(records[i].output_length + 18 == member_lengths[i]);
+  // block framing has no meaning for records, so the call is refused
+  ret = compress_ctx_set_flags(ctx, COMPRESS_BGZF);
+  assert(ret == 0);
+  ret = compress_batch_ctx(ctx, records.data(), records.size());
+  assert(ret == 1);
+  for (auto &record : records)
+    free(record.output);
+
+  // File to file through a mapping of the source, in every mode
+  for (int mode : modes) {
+    ret = compress_ctx_set_flags(ctx, mode);
+    assert(ret == 0);
+    unlink(argv[2]);
+    ret = compress_file_from_file(ctx, argv[1], argv[2]);
+    assert(ret == 0);
+    decompress_len = 0;
+    decompress_file(argv[2], decompress, &decompress_len);
+    assert(src_len == decompress_len);
+    assert(memcmp(src, decompress, src_len) == 0);
+  }
+
+  // Streamed in uneven chunks with a flush midway, in every mode
+  for (int mode : modes) {
+    ret = compress_ctx_set_flags(ctx, mode);
+    assert(ret == 0);
+    unlink(argv[2]);
+    compress_stream *stream = compress_stream_open(ctx, argv[2]);
+    assert(stream != NULL);
+    size_t pos = 0, chunk = 1;
+    while (pos < src_len) {
+      size_t n = src_len - pos < chunk ? src_len - pos : chunk;
+      ret = compress_stream_write(stream, src + pos, n);
+      assert(ret == 0);
+      pos += n;
+      chunk = chunk * 7 + 13; // from single bytes up past a block
+      if (chunk > 3 * BLOCK_SIZE)
+        chunk = 1;
+      if (pos >= src_len / 2 && pos - n < src_len / 2) {
+        ret = compress_stream_flush(stream);
+        assert(ret == 0);
+      }
+    }
+    ret = compress_stream_finish(stream);
+    assert(ret == 0);
+    decompress_len = 0;
+    decompress_file(argv[2], decompress, &decompress_len);
+    assert(src_len == decompress_len);
+    assert(memcmp(src, decompress, src_len) == 0);
+  }
+
+  // Straight to a descriptor, with O_DIRECT where the file system takes it
+  for (int mode : modes) {
+    ret = compress_ctx_set_flags(ctx, mode | COMPRESS_DIRECT_IO);
+    assert(ret == 0);
+    unlink(argv[2]);
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ret = compress_fd_ctx(ctx, src, src_len, fd);
+    assert(ret == 0);
+    close(fd);
+    decompress_len = 0;
+    decompress_file(argv[2], decompress, &decompress_len);
+    assert(src_len == decompress_len);
+    assert(memcmp(src, decompress, src_len) == 0);
+  }
+  gzip_index_free(index);
+  unlink(index_name.c_str());
+  compress_ctx_destroy(ctx);
+
+  // Auto-tuned options pick blocks from the input size
+  igzip_options opts;
+  igzip_options_init(&opts);
+  igzip_options_tune(&opts, 100 * 1024);
+  assert(opts.block_size == MIN_BLOCK_SIZE && opts.thread_num <= 2);
+  igzip_options_init(&opts);
+  opts.thread_num = 4;
+  igzip_options_tune(&opts, (size_t)1 << 36);
+  assert(opts.block_size == MAX_BLOCK_SIZE && opts.queue_depth >= 8);
+
+  // Small blocks, an odd queue depth and unaligned I/O buffers
+  for (int mode : modes) {
+    igzip_options_init(&opts);
+    opts.thread_num = THREAD_NUM;
+    opts.flags = mode;
+    opts.block_size = MIN_BLOCK_SIZE;
+    opts.queue_depth = 3;
+    opts.io_buffer_size = 100000;
+    unlink(argv[2]);
+    ret = compress_file_opts(src, src_len, argv[2], &opts);
+    assert(ret == 0);
+    decompress_len = 0;
+    ret = decompress_file_opts(argv[2], decompress, src_len, &decompress_len,
+                               &opts);
+    assert(ret == 0);
+    assert(src_len == decompress_len);
+    assert(memcmp(src, decompress, src_len) == 0);
+  }
+
+  // Workers pinned to CPU 0, then spread over the NUMA nodes
+  for (int numa = 0; numa <= 1; numa++) {
+    igzip_options_init(&opts);
+    opts.thread_num = THREAD_NUM;
+    opts.cpus = numa ? NULL : "0";
+    opts.numa = numa;
+    opts.block_size = MIN_BLOCK_SIZE;
+    unlink(argv[2]);
+    ret = compress_file_opts(src, src_len, argv[2], &opts);
+    assert(ret == 0);
+    decompress_len = 0;
+    ret = decompress_file(argv[2], decompress, &decompress_len);
+    assert(ret == 0);
+    assert(src_len == decompress_len);
+    assert(memcmp(src, decompress, src_len) == 0);
+  }
+#ifdef HAVE_THREADS
+  igzip_options_init(&opts);
+  opts.cpus = "3-1";
+  compress_ctx *rejected = compress_ctx_create_opts(&opts);
+  assert(rejected == NULL);
+#endif
+
+  // Per call stats add up to what reached the file, and to the totals
+  igzip_stats stats, before, after;
+  igzip_stats_get(&before, NULL);
+  igzip_options_init(&opts);
+  opts.thread_num = THREAD_NUM;
+  opts.level = 3;
+  opts.stats = &stats;
+  unlink(argv[2]);
+  ret = compress_file_opts(src, src_len, argv[2], &opts);
+  assert(ret == 0);
+  struct stat out_stat;
+  ret = stat(argv[2], &out_stat);
+  assert(ret == 0);
+  assert(stats.calls == 1 && stats.bytes_in == src_len);
+  assert(stats.bytes_out == (uint64_t)out_stat.st_size);
+  assert(stats.write_calls > 0 && stats.worker_count >= 1);
+  assert(stats.deflate_ns > 0 && stats.total_ns > 0);
+  igzip_stats_get(&after, NULL);
+  assert(after.calls - before.calls >= 1);
+  assert(after.bytes_in - before.bytes_in >= src_len);
+  decompress_len = 0;
+  ret = decompress_file_opts(argv[2], decompress, src_len, &decompress_len,
+                             &opts);
+  assert(ret == 0);
+  assert(stats.bytes_in == (uint64_t)out_stat.st_size);
+  assert(stats.bytes_out == src_len && decompress_len == src_len);
+
+  // The trace of the calls above, empty unless built with IGZIP_TRACE
+  FILE *trace = tmpfile();
+  int events = igzip_trace_dump(trace);
+  assert(events >= 0 && (!_IGZIP_TRACE || events > 0));
+  fclose(trace);
+  igzip_trace_clear();
+
   std::cout << "Passed!" << std::endl;
 
   return 0;
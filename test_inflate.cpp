@@ -3,16 +3,19 @@
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <string>
 #include <thread>
 
 #define COMPARE_BLOCK 1024 * 1024
 #define READ_BUF_ONCE COMPARE_BLOCK
-#define BUFFER_SIZE 1ll << 31 // maximum 2GiB to store intermediate buffer
 
-void loadCheckBuffer(FILE *fp, unsigned char *check, size_t *length) {
+void loadCheckBuffer(FILE *fp, unsigned char *check, size_t capacity,
+                     size_t *length) {
   size_t read;
-  for (*length = 0; *length < BUFFER_SIZE; *length += read) {
-    read = fread(check + (*length), 1, READ_BUF_ONCE, fp);
+  for (*length = 0; *length < capacity; *length += read) {
+    size_t want = capacity - *length;
+    read = fread(check + (*length), 1,
+                 want < READ_BUF_ONCE ? want : READ_BUF_ONCE, fp);
     if (read == 0) {
       break;
     } else if (read == -1) {
@@ -21,13 +24,39 @@ void loadCheckBuffer(FILE *fp, unsigned char *check, size_t *length) {
   }
 }
 
+struct StreamCheck {
+  const unsigned char *check;
+  size_t length;
+  size_t pos;
+  size_t chunk;
+};
+
+// Every chunk but the last is full and continues where the previous ended
+int compareChunk(void *opaque, const unsigned char *data, size_t length) {
+  StreamCheck *sc = (StreamCheck *)opaque;
+  if (sc->pos + length > sc->length ||
+      memcmp(sc->check + sc->pos, data, length) != 0)
+    return 1;
+  if (length != sc->chunk && sc->pos + length != sc->length)
+    return 1;
+  sc->pos += length;
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
-  unsigned char *output = (unsigned char *)malloc(BUFFER_SIZE);
+  struct stat check_stat;
+  if (stat(argv[2], &check_stat) != 0) {
+    log_print(ERROR, "Cannot stat check file\n");
+    exit(-1);
+  }
+  // size both buffers from the check file instead of a worst-case guess
+  size_t capacity = check_stat.st_size;
+  unsigned char *output = (unsigned char *)malloc(capacity + 1);
   if (output == NULL) {
     log_print(ERROR, "Cannot malloc output buffer\n");
     exit(-1);
   }
-  unsigned char *check = (unsigned char *)malloc(BUFFER_SIZE);
+  unsigned char *check = (unsigned char *)malloc(capacity + 1);
   if (check == NULL) {
     log_print(ERROR, "Cannot malloc check buffer\n");
     exit(-1);
@@ -39,12 +68,13 @@ int main(int argc, char *argv[]) {
   }
   size_t checkLength = 0, inflatedLength = -1;
 
-  std::thread readCheckBuffer(&loadCheckBuffer, fileCheck, check, &checkLength);
+  std::thread readCheckBuffer(&loadCheckBuffer, fileCheck, check, capacity,
+                              &checkLength);
 
   std::chrono::steady_clock::time_point begin =
       std::chrono::steady_clock::now();
 
-  decompress_file(argv[1], output, &inflatedLength);
+  int ret = decompress_file_bounded(argv[1], output, capacity, &inflatedLength);
 
   std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
 
@@ -55,9 +85,87 @@ int main(int argc, char *argv[]) {
 
   readCheckBuffer.join();
 
+  assert(ret == 0);
   assert(checkLength == inflatedLength);
   assert(memcmp(check, output, checkLength) == 0);
 
+  // Concatenated members may be inflated concurrently, same result expected
+  size_t parallelLength = 0;
+  memset(output, 0, capacity);
+  ret = decompress_file_mt(argv[1], output, capacity, &parallelLength, 4);
+  assert(ret == 0);
+  assert(parallelLength == checkLength);
+  assert(memcmp(check, output, checkLength) == 0);
+
+  if (capacity > 0) {
+    // one byte short of the data must be refused rather than overrun
+    size_t shortLength = 0;
+    ret = decompress_file_bounded(argv[1], output, capacity - 1, &shortLength);
+    assert(ret == BUFFER_TOO_SMALL);
+    assert(shortLength == capacity - 1);
+  }
+
+  // ISIZE gives the size up front, and the output is allocated to match
+  size_t queriedLength = 0;
+  int sizeFlags = 0;
+  ret = gzip_file_size(argv[1], &queriedLength, &sizeFlags);
+  assert(ret == 0);
+  if (sizeFlags == 0)
+    assert(queriedLength == checkLength);
+  unsigned char *allocated = NULL;
+  size_t allocatedLength = 0;
+  ret = decompress_file_alloc(argv[1], &allocated, &allocatedLength, 4);
+  assert(ret == 0);
+  assert(allocatedLength == checkLength);
+  assert(memcmp(check, allocated, checkLength) == 0);
+  igzip_free(allocated);
+
+  // Streamed in small fixed chunks without a whole-output buffer
+  StreamCheck streamCheck = {check, checkLength, 0, 4096};
+  size_t streamedLength = 0;
+  ret = decompress_file_stream(argv[1], streamCheck.chunk, compareChunk,
+                               &streamCheck, &streamedLength);
+  assert(ret == 0);
+  assert(streamedLength == checkLength);
+  assert(streamCheck.pos == checkLength);
+
+  // An index built by a first full inflate serves the tail of the data
+  gzip_index *index = gzip_index_build(argv[1], BLOCK_SIZE);
+  assert(index != NULL);
+  size_t rangeLength = 0, offset = checkLength / 2;
+  ret = gzip_index_read(index, argv[1], offset, output, capacity,
+                        &rangeLength);
+  assert(ret == 0);
+  assert(rangeLength == checkLength - offset);
+  assert(memcmp(check + offset, output, rangeLength) == 0);
+  gzip_index_free(index);
+
+  // One member spanning many spans gets points at block boundaries inside
+  // it, so reads past the first span start from one of those
+  std::string singleName = std::string(argv[1]) + ".single.gz";
+  ret = compress_file(check, checkLength, singleName.c_str(), 1, 1);
+  assert(ret == 0);
+  size_t span = 64 * 1024;
+  index = gzip_index_build(singleName.c_str(), span);
+  assert(index != NULL);
+  if (checkLength >= 8 * span)
+    assert(gzip_index_next_point(index) > 2 * span);
+  size_t offsets[] = {span + 1, checkLength / 3, checkLength / 2 + 4095,
+                      checkLength > 100 ? checkLength - 100 : 0};
+  for (size_t start : offsets) {
+    if (start >= checkLength)
+      continue;
+    size_t want = checkLength - start < 3 * span ? checkLength - start
+                                                 : 3 * span;
+    ret = gzip_index_read(index, singleName.c_str(), start, output, want,
+                          &rangeLength);
+    assert(ret == 0);
+    assert(rangeLength == want);
+    assert(memcmp(check + start, output, want) == 0);
+  }
+  gzip_index_free(index);
+  unlink(singleName.c_str());
+
   std::cout << "Passed!" << std::endl;
 
   return 0;
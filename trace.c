@@ -0,0 +1,237 @@
+#include "igzip_wrapper.h"
+
+#if _IGZIP_TRACE && defined(HAVE_THREADS)
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if _IGZIP_TRACE
+/*
+ * Every thread that records an event gets a ring of its own, so an event
+ * costs a clock read and a few stores to memory no other thread writes.
+ * Rings are linked into a list on first use and stay on it, a dump still
+ * shows the workers of a pool destroyed since. When a thread exits its ring
+ * goes to a free list and the next new thread carries on in it, so there
+ * are only ever as many rings as threads tracing at once.
+ */
+struct trace_record {
+  uint64_t ns;
+  uint64_t arg;
+  uint32_t type;
+  uint32_t phase;
+};
+
+struct trace_ring {
+  struct trace_record events[IGZIP_TRACE_EVENTS];
+#if defined(HAVE_THREADS)
+  _Atomic uint64_t head; // events recorded, stored by the owner only
+#else
+  uint64_t head;
+#endif
+  uint64_t start; // first event after the last clear
+  const char *name;
+  int tid;
+  struct trace_ring *next;
+  struct trace_ring *free_next; // on the free list, once its thread is gone
+};
+
+static const char *const trace_names[] = {
+    "submit", "stall", "deflate", "crc", "write",
+    "wait",   "read",  "refill",  "inflate"};
+// what the argument of a begin event counts
+static const char *const trace_args[] = {
+    "job",  "job",   "bytes",  "bytes", "bytes",
+    "job",  "bytes", "offset", "bytes"};
+
+#if defined(HAVE_THREADS)
+static _Atomic(struct trace_ring *) trace_rings;
+static _Atomic int trace_tids;
+static _Atomic int trace_on = 1;
+static _Thread_local struct trace_ring *trace_own;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_free_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_free;
+#else
+static struct trace_ring *trace_rings;
+static int trace_tids;
+static int trace_on = 1;
+static struct trace_ring *trace_own;
+#endif
+
+#if defined(HAVE_THREADS)
+// Thread exit: the ring keeps its events and waits for the next thread
+static void trace_ring_release(void *arg) {
+  struct trace_ring *ring = (struct trace_ring *)arg;
+  trace_own = NULL;
+  pthread_mutex_lock(&trace_free_lock);
+  ring->free_next = trace_free;
+  trace_free = ring;
+  pthread_mutex_unlock(&trace_free_lock);
+}
+
+static void trace_key_create(void) {
+  pthread_key_create(&trace_key, trace_ring_release);
+}
+#endif
+
+static struct trace_ring *trace_ring_get(void) {
+  struct trace_ring *ring = trace_own;
+  if (ring != NULL)
+    return ring;
+
+#if defined(HAVE_THREADS)
+  pthread_once(&trace_key_once, trace_key_create);
+  pthread_mutex_lock(&trace_free_lock);
+  ring = trace_free;
+  if (ring != NULL)
+    trace_free = ring->free_next;
+  pthread_mutex_unlock(&trace_free_lock);
+  if (ring != NULL) {
+    ring->name = NULL;
+    pthread_setspecific(trace_key, ring);
+    trace_own = ring;
+    return ring;
+  }
+#endif
+
+  ring = (struct trace_ring *)malloc_safe(sizeof(struct trace_ring));
+  ring->start = 0;
+  ring->name = NULL;
+#if defined(HAVE_THREADS)
+  atomic_init(&ring->head, 0);
+  ring->tid = atomic_fetch_add(&trace_tids, 1) + 1;
+  // Push onto the list, readers only ever walk it
+  ring->next = atomic_load(&trace_rings);
+  while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring))
+    ;
+  pthread_setspecific(trace_key, ring);
+#else
+  ring->head = 0;
+  ring->tid = ++trace_tids;
+  ring->next = trace_rings;
+  trace_rings = ring;
+#endif
+  trace_own = ring;
+  return ring;
+}
+
+void trace_event(int type, int phase, uint64_t arg) {
+#if defined(HAVE_THREADS)
+  if (!atomic_load_explicit(&trace_on, memory_order_relaxed))
+    return;
+#else
+  if (!trace_on)
+    return;
+#endif
+  struct trace_ring *ring = trace_ring_get();
+#if defined(HAVE_THREADS)
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+#else
+  uint64_t head = ring->head;
+#endif
+  struct trace_record *e = &ring->events[head % IGZIP_TRACE_EVENTS];
+
+  e->ns = igzip_clock_ns();
+  e->arg = arg;
+  e->type = type;
+  e->phase = phase;
+#if defined(HAVE_THREADS)
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+#else
+  ring->head = head + 1;
+#endif
+}
+
+void trace_thread_name(const char *name) { trace_ring_get()->name = name; }
+
+static uint64_t trace_head(struct trace_ring *ring) {
+#if defined(HAVE_THREADS)
+  return atomic_load_explicit(&ring->head, memory_order_acquire);
+#else
+  return ring->head;
+#endif
+}
+
+static struct trace_ring *trace_first(void) {
+#if defined(HAVE_THREADS)
+  return atomic_load_explicit(&trace_rings, memory_order_acquire);
+#else
+  return trace_rings;
+#endif
+}
+#endif
+
+void igzip_trace_enable(int on) {
+#if _IGZIP_TRACE && defined(HAVE_THREADS)
+  atomic_store(&trace_on, on != 0);
+#elif _IGZIP_TRACE
+  trace_on = on != 0;
+#else
+  (void)on;
+#endif
+}
+
+void igzip_trace_clear(void) {
+#if _IGZIP_TRACE
+  struct trace_ring *ring;
+  for (ring = trace_first(); ring != NULL; ring = ring->next)
+    ring->start = trace_head(ring);
+#endif
+}
+
+int igzip_trace_dump(FILE *out) {
+  int count = 0;
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+#if _IGZIP_TRACE
+  struct trace_ring *ring;
+  int pid = getpid();
+  const char *sep = "\n";
+
+  for (ring = trace_first(); ring != NULL; ring = ring->next) {
+    uint64_t head = trace_head(ring), i;
+    uint64_t first = head > IGZIP_TRACE_EVENTS ? head - IGZIP_TRACE_EVENTS : 0;
+    int depth = 0;
+
+    if (first < ring->start)
+      first = ring->start;
+    if (ring->name != NULL) {
+      fprintf(out,
+              "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+              "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              sep, pid, ring->tid, ring->name);
+      sep = ",\n";
+    }
+    for (i = first; i < head; i++) {
+      struct trace_record *e = &ring->events[i % IGZIP_TRACE_EVENTS];
+      // An end whose begin was overwritten or cleared would unbalance it
+      if (e->phase == 'E' && depth == 0)
+        continue;
+      depth += e->phase == 'B' ? 1 : -1;
+      fprintf(out,
+              "%s{\"name\":\"%s\",\"cat\":\"igzip\",\"ph\":\"%c\","
+              "\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d",
+              sep, trace_names[e->type], (char)e->phase,
+              (unsigned long long)(e->ns / 1000),
+              (unsigned long long)(e->ns % 1000), pid, ring->tid);
+      if (e->phase == 'B')
+        fprintf(out, ",\"args\":{\"%s\":%llu}", trace_args[e->type],
+                (unsigned long long)e->arg);
+      fprintf(out, "}");
+      sep = ",\n";
+      count++;
+    }
+  }
+#endif
+  fprintf(out, "\n]}\n");
+  return ferror(out) ? -1 : count;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
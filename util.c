@@ -1,9 +1,36 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
 #include "igzip_wrapper.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#if defined(HAVE_THREADS)
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Runtime copies of the config macros, changed with the setters below
+static int verbose_level = _IGZIP_VERBOSE_LEVEL;
+static int is_interactive = _IGZIP_IS_INTERACTIVE;
+static int force_overwrite = _IGZIP_FILE_FORCE_OVERRITTEN;
+
+void igzip_set_verbose_level(int level) { verbose_level = level; }
+
+void igzip_set_overwrite(int interactive, int force) {
+  is_interactive = interactive;
+  force_overwrite = force;
+}
+
 void log_print(int log_type, char *format, ...) {
   va_list args;
   va_start(args, format);
@@ -13,15 +40,15 @@ void log_print(int log_type, char *format, ...) {
     vfprintf(stdout, format, args);
     break;
   case WARN:
-    if ((_IGZIP_VERBOSE_LEVEL) > 1)
+    if (verbose_level > 1)
       vfprintf(stderr, format, args);
     break;
   case ERROR:
-    if ((_IGZIP_VERBOSE_LEVEL) > 0)
+    if (verbose_level > 0)
       vfprintf(stderr, format, args);
     break;
   case VERBOSE:
-    if ((_IGZIP_VERBOSE_LEVEL) > 2)
+    if (verbose_level > 2)
       vfprintf(stderr, format, args);
     break;
   }
@@ -29,12 +56,133 @@ void log_print(int log_type, char *format, ...) {
   va_end(args);
 }
 
+uint64_t igzip_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Process wide totals, one set for compression and one for decompression.
+ * igzip_stats is nothing but counters, so it is summed field by field and
+ * every call costs one relaxed atomic add per field when it ends.
+ */
+#define STATS_FIELDS (sizeof(igzip_stats) / sizeof(uint64_t))
+#define STATS_WORKER_COUNT                                                     \
+  (offsetof(igzip_stats, worker_count) / sizeof(uint64_t))
+
+#if defined(HAVE_THREADS)
+static _Atomic uint64_t stats_total[2][STATS_FIELDS];
+#else
+static uint64_t stats_total[2][STATS_FIELDS];
+#endif
+
+void igzip_stats_busy(igzip_stats *stats, size_t worker, uint64_t ns) {
+  if (worker >= stats->worker_count)
+    stats->worker_count = worker + 1;
+  if (worker >= IGZIP_STATS_MAX_WORKERS)
+    worker = IGZIP_STATS_MAX_WORKERS - 1;
+  stats->worker_busy_ns[worker] += ns;
+}
+
+void igzip_stats_commit(igzip_stats *call, int decompress, igzip_stats *out) {
+  const uint64_t *field = (const uint64_t *)call;
+  size_t i;
+
+  call->calls = 1;
+  for (i = 0; i < STATS_FIELDS; i++) {
+    if (field[i] == 0)
+      continue;
+#if defined(HAVE_THREADS)
+    if (i == STATS_WORKER_COUNT) {
+      uint64_t seen = atomic_load_explicit(&stats_total[decompress != 0][i],
+                                           memory_order_relaxed);
+      while (seen < field[i] &&
+             !atomic_compare_exchange_weak_explicit(
+                 &stats_total[decompress != 0][i], &seen, field[i],
+                 memory_order_relaxed, memory_order_relaxed))
+        ;
+    } else {
+      atomic_fetch_add_explicit(&stats_total[decompress != 0][i], field[i],
+                                memory_order_relaxed);
+    }
+#else
+    if (i != STATS_WORKER_COUNT)
+      stats_total[decompress != 0][i] += field[i];
+    else if (stats_total[decompress != 0][i] < field[i])
+      stats_total[decompress != 0][i] = field[i];
+#endif
+  }
+  if (out != NULL)
+    *out = *call;
+}
+
+void igzip_stats_get(igzip_stats *compress, igzip_stats *decompress) {
+  igzip_stats *out[2] = {compress, decompress};
+  size_t i, j;
+
+  for (j = 0; j < 2; j++) {
+    if (out[j] == NULL)
+      continue;
+    for (i = 0; i < STATS_FIELDS; i++)
+#if defined(HAVE_THREADS)
+      ((uint64_t *)out[j])[i] =
+          atomic_load_explicit(&stats_total[j][i], memory_order_relaxed);
+#else
+      ((uint64_t *)out[j])[i] = stats_total[j][i];
+#endif
+  }
+}
+
+void igzip_stats_reset(void) {
+  size_t i, j;
+  for (j = 0; j < 2; j++)
+    for (i = 0; i < STATS_FIELDS; i++)
+#if defined(HAVE_THREADS)
+      atomic_store_explicit(&stats_total[j][i], 0, memory_order_relaxed);
+#else
+      stats_total[j][i] = 0;
+#endif
+}
+
+static void *default_alloc(void *opaque, size_t size, size_t alignment) {
+  void *ptr = NULL;
+  (void)opaque;
+  if (alignment <= 2 * sizeof(void *))
+    return malloc(size);
+  if (posix_memalign(&ptr, alignment, size) != 0)
+    return NULL;
+  return ptr;
+}
+
+static void default_release(void *opaque, void *ptr) {
+  (void)opaque;
+  free(ptr);
+}
+
+static igzip_allocator allocator = {default_alloc, default_release, NULL};
+
+void igzip_set_allocator(const igzip_allocator *hook) {
+  if (hook == NULL || hook->alloc == NULL || hook->release == NULL) {
+    allocator.alloc = default_alloc;
+    allocator.release = default_release;
+    allocator.opaque = NULL;
+  } else {
+    allocator = *hook;
+  }
+}
+
+void igzip_free(void *ptr) {
+  if (ptr != NULL)
+    allocator.release(allocator.opaque, ptr);
+}
+
 void *malloc_safe(size_t size) {
   void *ptr = NULL;
   if (size == 0)
     return ptr;
 
-  ptr = malloc(size);
+  ptr = allocator.alloc(allocator.opaque, size, 2 * sizeof(void *));
   if (ptr == NULL) {
     log_print(ERROR, "igzip: Failed to allocate memory\n");
     exit(MALLOC_FAILED);
@@ -43,6 +191,27 @@ void *malloc_safe(size_t size) {
   return ptr;
 }
 
+void *realloc_safe(void *ptr, size_t old_size, size_t size) {
+  void *grown;
+  if (allocator.alloc == default_alloc) {
+    grown = realloc(ptr, size);
+    if (grown == NULL && size > 0) {
+      log_print(ERROR, "igzip: Failed to allocate memory\n");
+      exit(MALLOC_FAILED);
+    }
+    return grown;
+  }
+  // A hook has no realloc: shrinking keeps the block, growing copies
+  if (size <= old_size && size > 0)
+    return ptr;
+  grown = malloc_safe(size);
+  if (ptr != NULL) {
+    memcpy(grown, ptr, old_size < size ? old_size : size);
+    igzip_free(ptr);
+  }
+  return grown;
+}
+
 FILE *fopen_safe(const char *file_name, char *mode) {
   FILE *file;
   int answer = 0, tmp;
@@ -51,7 +220,7 @@ FILE *fopen_safe(const char *file_name, char *mode) {
   if (mode[0] == 'w') {
     if (access(file_name, F_OK) == 0) {
       log_print(WARN, "igzip: %s already exists;", file_name);
-      if (_IGZIP_IS_INTERACTIVE) {
+      if (is_interactive) {
         log_print(WARN, " do you wish to overwrite (y/n)?");
         answer = getchar();
 
@@ -63,7 +232,7 @@ FILE *fopen_safe(const char *file_name, char *mode) {
           log_print(WARN, " not overwritten\n");
           return NULL;
         }
-      } else if (!(_IGZIP_FILE_FORCE_OVERRITTEN)) {
+      } else if (!force_overwrite) {
         log_print(WARN, " not overwritten\n");
         return NULL;
       }
@@ -112,7 +281,7 @@ void open_out_file(FILE **out, const char *outfile_name) {
     *out = stdout;
   else if (outfile_name != NULL)
     *out = fopen_safe(outfile_name, "wb");
-  else if (!isatty(fileno(stdout)) || (_IGZIP_FILE_FORCE_OVERRITTEN))
+  else if (!isatty(fileno(stdout)) || force_overwrite)
     *out = stdout;
   else {
     log_print(WARN,
@@ -133,6 +302,88 @@ size_t fread_safe(void *buf, size_t word_size, size_t buf_size, FILE *in,
   return read_size;
 }
 
+unsigned char *fread_all(FILE *in, const char *file_name, size_t *length) {
+  struct stat in_stat;
+  size_t capacity = BLOCK_SIZE, read_size;
+  unsigned char *buf;
+
+  // Regular files are read in one go, pipes grow the buffer as they go
+  if (fstat(fileno(in), &in_stat) == 0 && S_ISREG(in_stat.st_mode) &&
+      in_stat.st_size > 0)
+    capacity = in_stat.st_size + 1;
+
+  buf = (unsigned char *)malloc_safe(capacity);
+  *length = 0;
+  for (;;) {
+    if (*length == capacity) {
+      capacity *= 2;
+      buf = (unsigned char *)realloc_safe(buf, capacity / 2, capacity);
+    }
+    read_size =
+        fread_safe(buf + *length, 1, capacity - *length, in, file_name);
+    *length += read_size;
+    if (read_size == 0 || feof(in))
+      break;
+  }
+  return buf;
+}
+
+unsigned char *mmap_in_file(FILE *in, const char *file_name, size_t *length) {
+  struct stat in_stat;
+  void *map;
+
+  // Only a regular file read from its start maps, pipes and stdin can't
+  if (fstat(fileno(in), &in_stat) != 0 || !S_ISREG(in_stat.st_mode) ||
+      in_stat.st_size == 0 || ftello(in) != 0)
+    return NULL;
+
+  map = mmap(NULL, in_stat.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+  if (map == MAP_FAILED) {
+    log_print(VERBOSE, "igzip: Cannot map %s, reading it instead\n",
+              file_name);
+    return NULL;
+  }
+  // Let the kernel read ahead as the pass goes, callers that want more of
+  // the file resident ask for it with load_in_file or mmap_slide
+  madvise(map, in_stat.st_size, MADV_SEQUENTIAL);
+  *length = in_stat.st_size;
+  return (unsigned char *)map;
+}
+
+void mmap_slide(unsigned char *map, size_t length, size_t *dropped,
+                size_t pos) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t behind = pos / page * page;
+  size_t ahead = length - behind < MMAP_WINDOW ? length - behind : MMAP_WINDOW;
+
+  // Pages before pos are consumed, a private read-only mapping just drops
+  // them and faults them in from the file again should anyone look back
+  if (behind > *dropped) {
+    madvise(map + *dropped, behind - *dropped, MADV_DONTNEED);
+    *dropped = behind;
+  }
+  if (ahead > 0)
+    madvise(map + behind, ahead, MADV_WILLNEED);
+}
+
+unsigned char *load_in_file(FILE *in, const char *file_name, size_t *length,
+                            bool *mapped) {
+  unsigned char *data = mmap_in_file(in, file_name, length);
+  *mapped = data != NULL;
+  if (data != NULL)
+    madvise(data, *length, MADV_WILLNEED); // all of it is wanted, any order
+  else
+    data = fread_all(in, file_name, length);
+  return data;
+}
+
+void release_in_file(unsigned char *data, size_t length, bool mapped) {
+  if (mapped)
+    munmap(data, length);
+  else
+    igzip_free(data);
+}
+
 size_t fwrite_safe(void *buf, size_t word_size, size_t buf_size, FILE *out,
                    const char *file_name) {
   size_t write_size;
@@ -145,6 +396,285 @@ size_t fwrite_safe(void *buf, size_t word_size, size_t buf_size, FILE *out,
   return write_size;
 }
 
+void *malloc_aligned_safe(size_t alignment, size_t size) {
+  void *ptr = allocator.alloc(allocator.opaque, size, alignment);
+  if (ptr == NULL) {
+    log_print(ERROR, "igzip: Failed to allocate memory\n");
+    exit(MALLOC_FAILED);
+  }
+  return ptr;
+}
+
+/*
+ * Per-thread cache of recently released buffers, matched by exact size.
+ * The library asks for the same few sizes over and over (blocks, level
+ * buffers, inflate states), so a thread making repeated calls gets back
+ * buffers whose pages are already faulted in instead of going back to the
+ * allocator. Whatever is still cached is released when the thread exits.
+ */
+struct buffer_cache {
+  void *ptr[BUFFER_CACHE_SLOTS];
+  size_t size[BUFFER_CACHE_SLOTS];
+  size_t total;
+};
+
+#if defined(HAVE_THREADS)
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void buffer_cache_release(void *arg) {
+  struct buffer_cache *cache = (struct buffer_cache *)arg;
+  int i;
+  for (i = 0; i < BUFFER_CACHE_SLOTS; i++)
+    igzip_free(cache->ptr[i]);
+  igzip_free(cache);
+}
+
+static void buffer_cache_key_create(void) {
+  pthread_key_create(&cache_key, buffer_cache_release);
+}
+
+static struct buffer_cache *buffer_cache_get(void) {
+  struct buffer_cache *cache;
+  pthread_once(&cache_once, buffer_cache_key_create);
+  cache = (struct buffer_cache *)pthread_getspecific(cache_key);
+  if (cache == NULL) {
+    cache = (struct buffer_cache *)malloc_safe(sizeof(struct buffer_cache));
+    memset(cache, 0, sizeof(struct buffer_cache));
+    pthread_setspecific(cache_key, cache);
+  }
+  return cache;
+}
+#else
+// Without pthread keys nothing runs at thread exit, the cache stays behind
+static struct buffer_cache *buffer_cache_get(void) {
+  static _Thread_local struct buffer_cache cache;
+  return &cache;
+}
+#endif
+
+void *cache_alloc(size_t size) {
+  struct buffer_cache *cache = buffer_cache_get();
+  int i;
+  for (i = 0; i < BUFFER_CACHE_SLOTS; i++) {
+    if (cache->ptr[i] != NULL && cache->size[i] == size) {
+      void *ptr = cache->ptr[i];
+      cache->ptr[i] = NULL;
+      cache->total -= size;
+      return ptr;
+    }
+  }
+  // aligned so that any cached buffer may back O_DIRECT I/O
+  return malloc_aligned_safe(DIRECT_IO_ALIGN, size > 0 ? size : 1);
+}
+
+void cache_free(void *ptr, size_t size) {
+  struct buffer_cache *cache;
+  int i;
+  if (ptr == NULL)
+    return;
+  cache = buffer_cache_get();
+  if (cache->total + size <= BUFFER_CACHE_BYTES) {
+    for (i = 0; i < BUFFER_CACHE_SLOTS; i++) {
+      if (cache->ptr[i] == NULL) {
+        cache->ptr[i] = ptr;
+        cache->size[i] = size;
+        cache->total += size;
+        return;
+      }
+    }
+  }
+  igzip_free(ptr);
+}
+
+int parse_cpu_list(const char *list, int *cpus, int max_cpus) {
+  const char *p = list;
+  int count = 0;
+
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    long first = strtol(p, &end, 10), last;
+    if (end == p || first < 0)
+      return -1;
+    last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        return -1;
+    }
+    for (; first <= last; first++) {
+      if (count == max_cpus)
+        return -1;
+      cpus[count++] = (int)first;
+    }
+    p = end;
+    if (*p == ',')
+      p++;
+    else if (*p != '\0' && *p != '\n')
+      return -1;
+  }
+  return count;
+}
+
+void cpu_nodes(int *node, int max_cpu) {
+  DIR *dir = opendir("/sys/devices/system/node");
+  struct dirent *entry;
+  int *cpus, i, n, id;
+
+  for (i = 0; i < max_cpu; i++)
+    node[i] = 0;
+  if (dir == NULL)
+    return; // not NUMA, or no sysfs
+  cpus = (int *)malloc_safe(max_cpu * sizeof(int));
+  while ((entry = readdir(dir)) != NULL) {
+    char path[300], list[4096];
+    FILE *f;
+    if (sscanf(entry->d_name, "node%d", &id) != 1)
+      continue;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+             entry->d_name);
+    f = fopen(path, "r");
+    if (f == NULL)
+      continue;
+    if (fgets(list, sizeof(list), f) != NULL) {
+      n = parse_cpu_list(list, cpus, max_cpu);
+      for (i = 0; i < n; i++)
+        if (cpus[i] < max_cpu)
+          node[cpus[i]] = id;
+    }
+    fclose(f);
+  }
+  closedir(dir);
+  igzip_free(cpus);
+}
+
+static void out_fd_set_direct(out_fd *out, int on) {
+  int flags = fcntl(out->fd, F_GETFL);
+  if (flags == -1 ||
+      fcntl(out->fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) ==
+          -1) {
+    out->direct = 0; // not supported here, stay on buffered writes
+    return;
+  }
+  out->direct_on = on;
+}
+
+void out_fd_init(out_fd *out, int fd, const char *name, int direct) {
+  struct stat out_stat;
+  out->fd = fd;
+  out->name = name;
+  out->offset = 0;
+  out->direct_on = 0;
+  out->writes = 0;
+  out->write_ns = 0;
+  // Bypassing the page cache only makes sense for regular files
+  out->direct = direct && fstat(fd, &out_stat) == 0 &&
+                S_ISREG(out_stat.st_mode) && lseek(fd, 0, SEEK_CUR) == 0;
+}
+
+void out_fd_writev(out_fd *out, struct iovec *iov, int iovcnt) {
+  int i, aligned = out->direct && out->offset % DIRECT_IO_ALIGN == 0;
+  uint64_t start = igzip_clock_ns(), bytes = 0;
+
+  // O_DIRECT takes aligned runs at aligned offsets, the rest goes buffered
+  for (i = 0; aligned && i < iovcnt; i++)
+    aligned = (uintptr_t)iov[i].iov_base % DIRECT_IO_ALIGN == 0 &&
+              iov[i].iov_len % DIRECT_IO_ALIGN == 0;
+  if (out->direct && aligned != out->direct_on)
+    out_fd_set_direct(out, aligned);
+
+  for (i = 0; i < iovcnt; i++)
+    bytes += iov[i].iov_len;
+  TRACE_BEGIN(TRACE_WRITE, bytes);
+  while (iovcnt > 0) {
+    ssize_t n = writev(out->fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+    out->writes++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // non-blocking pipe or socket, wait until it drains
+        struct pollfd pfd = {out->fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      if (errno == EINVAL && out->direct_on) {
+        out_fd_set_direct(out, 0);
+        out->direct = 0;
+        continue;
+      }
+      log_print(ERROR, "igzip: Error encountered while writing to file %s\n",
+                out->name);
+      exit(FILE_WRITE_ERROR);
+    }
+    out->offset += n;
+    // Drop what went out, a pipe or socket may take part of a vector
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  TRACE_END(TRACE_WRITE);
+  out->write_ns += igzip_clock_ns() - start;
+}
+
+void out_fd_finish(out_fd *out) {
+  if (out->direct_on)
+    out_fd_set_direct(out, 0);
+}
+
+/*
+ * CRC-32 combination, after zlib's crc32_combine: the CRC of A|B equals the
+ * CRC of A multiplied by x^(8 * len(B)) modulo the gzip polynomial, xored
+ * with the CRC of B. x2n_table[k] holds x^(2^k) mod p.
+ */
+#define CRC32_POLY 0xedb88320
+
+static const uint32_t x2n_table[32] = {
+    0x40000000, 0x20000000, 0x08000000, 0x00800000, 0x00008000, 0xedb88320,
+    0xb1e6b092, 0xa06a2517, 0xed627dae, 0x88d14467, 0xd7bbfe6a, 0xec447f11,
+    0x8e7ea170, 0x6427800e, 0x4d47bae0, 0x09fe548f, 0x83852d0f, 0x30362f1a,
+    0x7b5a9cc3, 0x31fec169, 0x9fec022a, 0x6c8dedc4, 0x15d6874d, 0x5fde7a4e,
+    0xbad90e37, 0x2e4e5eef, 0x4eaba214, 0xa8a472c0, 0x429a969e, 0x148d302a,
+    0xc40ba6d0, 0xc4e22c3c};
+
+// a * b modulo p, both in reflected bit order
+static uint32_t crc_multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = (uint32_t)1 << 31, p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+  }
+  return p;
+}
+
+// x^(n * 2^k) modulo p
+static uint32_t crc_x2nmodp(uint64_t n, unsigned k) {
+  uint32_t p = (uint32_t)1 << 31; // x^0 == 1
+  while (n) {
+    if (n & 1)
+      p = crc_multmodp(x2n_table[k & 31], p);
+    n >>= 1;
+    k++;
+  }
+  return p;
+}
+
+uint32_t crc32_gzip_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+  return crc_multmodp(crc_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif